@@ -1,6 +1,7 @@
 #include "common.h"
 #include <iostream>
 #include <vector>
+#include <cstdio>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -43,11 +44,51 @@ glm::mat4 b_spline_matrix = transpose(glm::mat4(
 
 
 const int num_increments = 100;
-float xs[num_increments];
-float ys[num_increments];
 
 point4 vertices[num_increments];
 GLuint  ModelView, Projection;
+GLuint  vPosition;
+
+// Curve samples always have z = 0 and w = 1, so the compact formats only upload
+// x/y and let the vertex attribute defaults fill in the rest
+enum { Float4Format = 0, Half2Format = 1, Snorm2Format = 2, NumVertexFormats = 3 };
+const char *vertex_format_names[NumVertexFormats] = {
+	"float x/y/z/w (16 bytes per vertex)",
+	"half-float x/y (4 bytes per vertex)",
+	"16-bit normalized x/y (4 bytes per vertex)"
+};
+int vertex_format = Float4Format;
+std::vector<GLuint> packed_vertices;
+size_t upload_bytes = 0;
+size_t last_frame_upload_bytes = 0;
+
+
+// Upload n points into the bound array buffer using the current vertex format,
+// and point vPosition at them with the matching attribute layout
+void upload_vertices(const point4 *points, int n) {
+	if (vertex_format == Float4Format) {
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point4)*n, points, GL_STATIC_DRAW);
+		glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		upload_bytes += sizeof(point4)*n;
+		return;
+	}
+
+	packed_vertices.resize(n);
+	for (int i = 0; i < n; i++) {
+		point2 xy = point2(points[i].x, points[i].y);
+		if (vertex_format == Half2Format)
+			packed_vertices[i] = glm::packHalf2x16(xy);
+		else
+			packed_vertices[i] = glm::packSnorm2x16(xy);
+	}
+
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint)*n, &packed_vertices[0], GL_STATIC_DRAW);
+	if (vertex_format == Half2Format)
+		glVertexAttribPointer(vPosition, 2, GL_HALF_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+	else
+		glVertexAttribPointer(vPosition, 2, GL_SHORT, GL_TRUE, 0, BUFFER_OFFSET(0));
+	upload_bytes += sizeof(GLuint)*n;
+}
 
 
 point2 mouse_to_world(int x, int y) {
@@ -60,7 +101,7 @@ float time_multiply(float t, point4 v) {
 };
 
 
-void mouse_callback(int mouse_x, int mouse_y) {
+void motion(int mouse_x, int mouse_y) {
 	point2 mouse_coords = mouse_to_world(mouse_x, mouse_y);
 	float x = mouse_coords.x;
 	float y = mouse_coords.y;
@@ -80,24 +121,24 @@ public:
 		control_points = cps;
 		coeff_matrix = matrix;
 	}
-	void draw() {
+	// The num_increments points draw() joins up
+	void sample(point4 *out) {
 		point4 partial_result_x = coeff_matrix * point4(control_points[0][0], control_points[1][0], control_points[2][0], control_points[3][0]);
 		point4 partial_result_y = coeff_matrix * point4(control_points[0][1], control_points[1][1], control_points[2][1], control_points[3][1]);
 
 		for (int i = 0; i < num_increments; i++) {
-			xs[i] = time_multiply(1.0 / (num_increments - 1) * i, partial_result_x);
-			ys[i] = time_multiply(1.0 / (num_increments - 1) * i, partial_result_y);
+			float x = time_multiply(1.0 / (num_increments - 1) * i, partial_result_x);
+			float y = time_multiply(1.0 / (num_increments - 1) * i, partial_result_y);
+			out[i] = point4(x, y, 0.0, 1.0);
 		}
-
-		for (int i = 0; i < num_increments; i++) {
-			vertices[i] = point4(xs[i], ys[i], 0.0, 1.0);
-		}
-
-		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+	}
+	void draw() {
+		sample(vertices);
+		upload_vertices(vertices, num_increments);
 		glDrawArrays(GL_LINE_STRIP, 0, num_increments);
 	}
 	void draw_cps() {
-		glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(point4), control_points, GL_STATIC_DRAW);
+		upload_vertices(control_points, 4);
 		glPointSize(10.0f);
 		glDrawArrays(GL_POINTS, 0, 4);
 	}
@@ -109,6 +150,8 @@ class Curve {
 public:
 	virtual void draw() = 0;
 	virtual void add_control_point(point4 cp) = 0;
+	// The segments draw() draws, in order
+	virtual std::vector<CurveSegment> segments() = 0;
 };
 
 
@@ -116,15 +159,22 @@ class BezierCurve : public Curve {
 public:
 	virtual void draw() {
 		int n = control_points.size();
-		glBufferData(GL_ARRAY_BUFFER, sizeof(point4)*n, &control_points[0], GL_STATIC_DRAW);
+		upload_vertices(&control_points[0], n);
 		glPointSize(10.0f);
 		glDrawArrays(GL_POINTS, 0, n);
 
+		std::vector<CurveSegment> segs = segments();
+		for (int i = 0; i < segs.size(); i++)
+			segs[i].draw();
+	}
+	virtual std::vector<CurveSegment> segments() {
+		std::vector<CurveSegment> segs;
+		int n = control_points.size();
 		for (int i = 0; i < n; i+=3) {
-			CurveSegment seg = CurveSegment(&control_points[i], bezier_matrix);
 			if(n-i > 3)
-				seg.draw();
+				segs.push_back(CurveSegment(&control_points[i], bezier_matrix));
 		}
+		return segs;
 	}
 
 	virtual void add_control_point(point4 cp) {
@@ -137,12 +187,18 @@ class CatmullRomCurve : public Curve {
 public:
 	CatmullRomCurve() {};
 	virtual void draw() {
-		for (int i = 0; i < control_points.size() - 3; i++) {
-			CurveSegment seg = CurveSegment(&control_points[i], catmull_rom_matrix);
-			seg.draw();
-			seg.draw_cps();
+		std::vector<CurveSegment> segs = segments();
+		for (int i = 0; i < segs.size(); i++) {
+			segs[i].draw();
+			segs[i].draw_cps();
 		}
 	}
+	virtual std::vector<CurveSegment> segments() {
+		std::vector<CurveSegment> segs;
+		for (int i = 0; i < control_points.size() - 3; i++)
+			segs.push_back(CurveSegment(&control_points[i], catmull_rom_matrix));
+		return segs;
+	}
 	virtual void add_control_point(point4 cp) {
 		control_points.push_back(cp);
 	}
@@ -151,12 +207,18 @@ public:
 class BSplineCurve : public Curve {
 public:
 	virtual void draw() {
-		for (int i = 0; i < control_points.size() - 3; i++) {
-			CurveSegment seg = CurveSegment(&control_points[i], b_spline_matrix);
-			seg.draw();
-			seg.draw_cps();
+		std::vector<CurveSegment> segs = segments();
+		for (int i = 0; i < segs.size(); i++) {
+			segs[i].draw();
+			segs[i].draw_cps();
 		}
 	}
+	virtual std::vector<CurveSegment> segments() {
+		std::vector<CurveSegment> segs;
+		for (int i = 0; i < control_points.size() - 3; i++)
+			segs.push_back(CurveSegment(&control_points[i], b_spline_matrix));
+		return segs;
+	}
 	virtual void add_control_point(point4 cp) {
 		control_points.push_back(cp);
 	}
@@ -165,8 +227,48 @@ public:
 BezierCurve default_curve = BezierCurve();
 Curve *curve = &default_curve;
 
+// Write the current curve to an OBJ file as one polyline (an l element) of
+// num_increments points per segment, the points draw() joins up
+bool export_obj(const char *filename) {
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL) {
+		std::cerr << "Failed to write " << filename << std::endl;
+		return false;
+	}
+	static char buffer[1 << 16];
+	setvbuf(fp, buffer, _IOFBF, sizeof(buffer));
+
+	std::vector<CurveSegment> segs = curve->segments();
+	point4 points[num_increments];
+	fprintf(fp, "# %d segments of %d points\n", int(segs.size()), num_increments);
+	for (int s = 0; s < segs.size(); s++) {
+		segs[s].sample(points);
+		for (int i = 0; i < num_increments; i++)
+			fprintf(fp, "v %.9g %.9g %.9g\n", points[i].x, points[i].y, points[i].z);
+	}
+	// OBJ counts from 1
+	for (int s = 0; s < segs.size(); s++) {
+		fprintf(fp, "l");
+		for (int i = 0; i < num_increments; i++)
+			fprintf(fp, " %d", s * num_increments + i + 1);
+		fprintf(fp, "\n");
+	}
+	bool ok = !ferror(fp);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok)
+		std::cout << "Wrote " << segs.size() << " curve segments to " << filename << "\n";
+	return ok;
+}
+
 //----------------------------------------------------------------------------
 
+// Nothing here works without GL
+bool
+run_without_gl()
+{
+   return false;
+}
+
 // OpenGL initialization
 void
 init()
@@ -189,7 +291,7 @@ init()
    glUseProgram( program );
 
    // set up vertex arrays
-   GLuint vPosition = glGetAttribLocation( program, "vPosition" );
+   vPosition = glGetAttribLocation( program, "vPosition" );
    glEnableVertexAttribArray( vPosition );
    glVertexAttribPointer( vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
 
@@ -199,8 +301,6 @@ init()
    glEnable( GL_DEPTH_TEST );
    glClearColor( 1.0, 1.0, 1.0, 1.0 );
 
-   glutMotionFunc(mouse_callback);
-
    control_points.push_back(point4(-0.5, -0.5, 0.0, 1.0));
    control_points.push_back(point4(-0.1, 0.0, 0.0, 1.0));
    control_points.push_back(point4(0.3, 0.0, 0.0, 1.0));
@@ -227,9 +327,11 @@ display( void )
    model_view = trans * rot;
    glUniformMatrix4fv(ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
 
+   upload_bytes = 0;
    curve->draw();
+   last_frame_upload_bytes = upload_bytes;
 
-   glutSwapBuffers();
+   swap_buffers();
 }
 
 //----------------------------------------------------------------------------
@@ -258,6 +360,15 @@ keyboard( unsigned char key, int x, int y )
 			   std::cout << "Switching to Bezier Curve\n";
 		   }
 		   curve_index = (curve_index+1) % 3;
+		   break;
+	   case 'f': case 'F':
+		   std::cout << "Last frame uploaded " << last_frame_upload_bytes << " bytes\n";
+		   vertex_format = (vertex_format + 1) % NumVertexFormats;
+		   std::cout << "Switching to " << vertex_format_names[vertex_format] << " vertices\n";
+		   break;
+	   case 'e': case 'E':
+		   export_obj("curve.obj");
+		   break;
     }
 }
 
@@ -1,6 +1,9 @@
 // Based on: http://www.cs.unm.edu/~angel/BOOK/INTERACTIVE_COMPUTER_GRAPHICS/SIXTH_EDITION/CODE/CHAPTER03/WINDOWS_VERSIONS/example2.cpp
 // Modified to isolate the main program and use GLM
 
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <GL/glew.h>
 #ifdef __APPLE__  // include Mac OS X verions of headers
 #  include <OpenGL/gl.h>
@@ -18,17 +21,33 @@
 #define BUFFER_OFFSET( offset )   ((GLvoid*) (offset))
 
 extern GLuint InitShader(const char* vShaderFile, const char* fShaderFile);
+extern GLuint InitShader(const char* vShaderFile, const char* tcShaderFile,
+                         const char* teShaderFile, const char* fShaderFile);
+
+// Command line options, see main.cpp
+extern bool has_option(const char* name);
+extern const char* option_value(const char* name);
+
+// Present the finished frame; does nothing when rendering offscreen
+extern void swap_buffers(void);
+
+// Write RGB pixels, top row first, to a binary PPM file
+extern bool write_ppm(const char* filename, int width, int height, const unsigned char* rgb);
 
 // Implement the following...
 
 extern const char *WINDOW_TITLE;
 extern const double FRAME_RATE_MS;
 
+// Called before any GL context exists. Return true after doing work that
+// needs none, such as rendering on the CPU, and the program ends there.
+extern bool run_without_gl(void);
 extern void init(void);
 extern void update(void);
 extern void display(void);
 extern void keyboard(unsigned char key, int x, int y);
 extern void mouse(int button, int state, int x, int y);
+extern void motion(int x, int y);
 extern void reshape(int width, int height);
 
-
+#endif // COMMON_H
@@ -3,7 +3,39 @@
 
  #include "common.h"
 
+#ifdef __linux__
+#  include <EGL/egl.h>
+#  include <EGL/eglext.h>
+#endif  // __linux__
+
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Command line options left over after glutInit has removed its own
+static int    option_count = 0;
+static char** options = NULL;
+
+bool
+has_option(const char* name)
+{
+   for ( int i = 1; i < option_count; ++i ) {
+      if ( strcmp( options[i], name ) == 0 ) { return true; }
+   }
+   return false;
+}
+
+// Return the argument following the named option, or NULL if there is none
+const char*
+option_value(const char* name)
+{
+   for ( int i = 1; i < option_count - 1; ++i ) {
+      if ( strcmp( options[i], name ) == 0 ) { return options[i + 1]; }
+   }
+   return NULL;
+}
 
 // Create a NULL-terminated string by reading the provided file
 static char*
@@ -27,22 +59,19 @@ readShaderSource(const char* shaderFile)
 }
 
 
-// Create a GLSL program object from vertex and fragment shader files
-GLuint
-InitShader(const char* vShaderFile, const char* fShaderFile)
-{
-   struct Shader {
-      const char*  filename;
-      GLenum       type;
-      GLchar*      source;
-   }  shaders[2] = {
-      { vShaderFile, GL_VERTEX_SHADER, NULL },
-      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
-   };
+struct Shader {
+   const char*  filename;
+   GLenum       type;
+   GLchar*      source;
+};
 
+// Compile and link a GLSL program object from a list of shader files
+static GLuint
+LinkShaders(Shader* shaders, int count)
+{
    GLuint program = glCreateProgram();
     
-   for ( int i = 0; i < 2; ++i ) {
+   for ( int i = 0; i < count; ++i ) {
       Shader& s = shaders[i];
       s.source = readShaderSource( s.filename );
       if ( shaders[i].source == NULL ) {
@@ -96,10 +125,358 @@ InitShader(const char* vShaderFile, const char* fShaderFile)
    return program;
 }
 
+// Create a GLSL program object from vertex and fragment shader files
+GLuint
+InitShader(const char* vShaderFile, const char* fShaderFile)
+{
+   Shader shaders[2] = {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+
+   return LinkShaders( shaders, 2 );
+}
+
+// Create a GLSL program object that also has tessellation control and
+// evaluation stages (needs OpenGL 4.0)
+GLuint
+InitShader(const char* vShaderFile, const char* tcShaderFile,
+           const char* teShaderFile, const char* fShaderFile)
+{
+   Shader shaders[4] = {
+      { vShaderFile, GL_VERTEX_SHADER, NULL },
+      { tcShaderFile, GL_TESS_CONTROL_SHADER, NULL },
+      { teShaderFile, GL_TESS_EVALUATION_SHADER, NULL },
+      { fShaderFile, GL_FRAGMENT_SHADER, NULL }
+   };
+
+   return LinkShaders( shaders, 4 );
+}
+
+//----------------------------------------------------------------------------
+// Input record/replay
+//
+// With --record <file> every input event is logged together with the frame it
+// arrived on and the elapsed time in ms. With --replay <file> live input is
+// ignored and the logged events are fed back through the same callbacks on
+// the same frames, so two builds see identical interaction traces. Frame
+// times are collected during the replay and summarised when it finishes.
+
+struct InputEvent {
+   int  frame;
+   int  time_ms;
+   char type;
+   int  a, b, c, d;
+};
+
+enum { KeyboardEvent = 'k', MouseEvent = 'm', MotionEvent = 'v', ReshapeEvent = 'r' };
+
+static FILE*                    record_file = NULL;
+static std::vector<InputEvent>  replay_events;
+static size_t                   replay_next = 0;
+static bool                     replaying = false;
+static bool                     replay_fed = false;
+static int                      replay_min_frames = 0;
+static int                      frame_count = 0;
+static std::vector<double>      frame_times_ms;
+static bool                     headless = false;
+
+static void
+record_event(char type, int a, int b, int c, int d)
+{
+   if ( record_file == NULL ) { return; }
+
+   fprintf( record_file, "%d %d %c %d %d %d %d\n", frame_count,
+            glutGet( GLUT_ELAPSED_TIME ), type, a, b, c, d );
+}
+
+static void
+load_replay(const char* filename)
+{
+   FILE* fp = fopen(filename, "r");
+
+   if ( fp == NULL ) {
+      std::cerr << "Failed to read " << filename << std::endl;
+      exit( EXIT_FAILURE );
+   }
+
+   char line[256];
+   while ( fgets( line, sizeof(line), fp ) != NULL ) {
+      InputEvent e;
+      if ( line[0] == '#' ) { continue; }
+      if ( sscanf( line, "%d %d %c %d %d %d %d", &e.frame, &e.time_ms, &e.type,
+                   &e.a, &e.b, &e.c, &e.d ) == 7 ) {
+         replay_events.push_back( e );
+      }
+   }
+   fclose(fp);
+
+   replaying = true;
+   replay_min_frames = option_value( "--frames" ) ? atoi( option_value( "--frames" ) ) : 0;
+   std::cout << "Replaying " << replay_events.size() << " input events from "
+             << filename << std::endl;
+}
+
+static void
+print_frame_stats(void)
+{
+   if ( frame_times_ms.empty() ) { return; }
+
+   std::vector<double> sorted( frame_times_ms );
+   std::sort( sorted.begin(), sorted.end() );
+
+   double total = 0.0;
+   for ( size_t i = 0; i < sorted.size(); ++i ) { total += sorted[i]; }
+
+   size_t n = sorted.size();
+   std::cout << "Frames: " << n
+             << "  mean: " << total / n << " ms"
+             << "  min: " << sorted[0] << " ms"
+             << "  median: " << sorted[n / 2] << " ms"
+             << "  p95: " << sorted[(n * 95) / 100] << " ms"
+             << "  p99: " << sorted[(n * 99) / 100] << " ms"
+             << "  max: " << sorted[n - 1] << " ms" << std::endl;
+}
+
+// Feed the callbacks every logged event that arrived on or before this frame
+static void
+replay_frame_events(void)
+{
+   while ( replay_next < replay_events.size() &&
+           replay_events[replay_next].frame <= frame_count ) {
+      const InputEvent& e = replay_events[replay_next++];
+      switch ( e.type ) {
+         case KeyboardEvent: keyboard( (unsigned char) e.a, e.b, e.c ); break;
+         case MouseEvent:    mouse( e.a, e.b, e.c, e.d );               break;
+         case MotionEvent:   motion( e.a, e.b );                        break;
+         case ReshapeEvent:  reshape( e.a, e.b );                       break;
+      }
+   }
+
+   if ( replay_next == replay_events.size() ) { replay_fed = true; }
+}
+
+// A replay ends once the frame its last event arrived on has been drawn and
+// timed, and no sooner than --frames frames, so a trace can end idle
+static bool
+replay_done(void)
+{
+   return replaying && replay_fed && frame_count >= replay_min_frames;
+}
+
+static void
+keyboard_input(unsigned char key, int x, int y)
+{
+   if ( replaying ) { return; }
+   record_event( KeyboardEvent, key, x, y, 0 );
+   keyboard( key, x, y );
+}
+
+static void
+mouse_input(int button, int state, int x, int y)
+{
+   if ( replaying ) { return; }
+   record_event( MouseEvent, button, state, x, y );
+   mouse( button, state, x, y );
+}
+
+static void
+motion_input(int x, int y)
+{
+   if ( replaying ) { return; }
+   record_event( MotionEvent, x, y, 0, 0 );
+   motion( x, y );
+}
+
+static void
+reshape_input(int width, int height)
+{
+   record_event( ReshapeEvent, width, height, 0, 0 );
+   reshape( width, height );
+}
+
+static void
+display_frame(void)
+{
+   std::chrono::high_resolution_clock::time_point start =
+      std::chrono::high_resolution_clock::now();
+
+   display();
+
+   if ( replaying || headless ) {
+      glFinish();
+      std::chrono::duration<double, std::milli> elapsed =
+         std::chrono::high_resolution_clock::now() - start;
+      frame_times_ms.push_back( elapsed.count() );
+   }
+
+   // Headless runs stop after writing the frame out
+   if ( !headless && replay_done() ) {
+      exit( EXIT_SUCCESS ); // frame statistics are printed by the atexit handler
+   }
+}
+
+static void
+advance_frame(void)
+{
+   if ( replaying ) { replay_frame_events(); }
+   ++frame_count;
+
+   update();
+}
+
+//----------------------------------------------------------------------------
+// Offscreen rendering
+//
+// With --headless the same init()/display() code renders into a framebuffer
+// object instead of a window. On Linux the context comes from EGL with no
+// surface at all (Mesa's llvmpipe works), so no display server is needed;
+// elsewhere a hidden GLUT window provides the context. --frames <n> sets how
+// many frames to render (for --replay, the fewest, since it runs to the end
+// of its trace) and --dump <prefix> writes every frame to <prefix>NNNN.ppm.
+
+const int OFFSCREEN_WIDTH = 640;
+const int OFFSCREEN_HEIGHT = 640;
+
+void
+swap_buffers(void)
+{
+   if ( !headless ) { glutSwapBuffers(); }
+}
+
+#ifdef __linux__
+static bool
+create_egl_context(void)
+{
+   EGLDisplay display = EGL_NO_DISPLAY;
+
+   PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+   if ( getPlatformDisplay != NULL ) {
+      display = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+   }
+   if ( display == EGL_NO_DISPLAY ) {
+      display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+   }
+   if ( display == EGL_NO_DISPLAY || !eglInitialize( display, NULL, NULL ) ) {
+      return false;
+   }
+
+   const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_NONE
+   };
+   EGLConfig config;
+   EGLint    num_configs = 0;
+   if ( !eglBindAPI( EGL_OPENGL_API ) ||
+        !eglChooseConfig( display, config_attribs, &config, 1, &num_configs ) ||
+        num_configs == 0 ) {
+      return false;
+   }
+
+   const EGLint context_attribs[] = {
+      EGL_CONTEXT_MAJOR_VERSION, 3,
+      EGL_CONTEXT_MINOR_VERSION, 2,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_NONE
+   };
+   EGLContext context = eglCreateContext( display, config, EGL_NO_CONTEXT, context_attribs );
+   if ( context == EGL_NO_CONTEXT ) {
+      return false;
+   }
+
+   return eglMakeCurrent( display, EGL_NO_SURFACE, EGL_NO_SURFACE, context ) == EGL_TRUE;
+}
+#endif  // __linux__
+
+static void
+create_framebuffer(int width, int height)
+{
+   GLuint fbo, color, depth;
+
+   glGenRenderbuffers( 1, &color );
+   glBindRenderbuffer( GL_RENDERBUFFER, color );
+   glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, width, height );
+
+   glGenRenderbuffers( 1, &depth );
+   glBindRenderbuffer( GL_RENDERBUFFER, depth );
+   glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height );
+
+   glGenFramebuffers( 1, &fbo );
+   glBindFramebuffer( GL_FRAMEBUFFER, fbo );
+   glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color );
+   glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth );
+
+   if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE ) {
+      std::cerr << "Offscreen framebuffer is incomplete" << std::endl;
+      exit( EXIT_FAILURE );
+   }
+}
+
+// Write width x height RGB pixels, rows from the top, as a binary PPM
+bool
+write_ppm(const char* filename, int width, int height, const unsigned char* rgb)
+{
+   FILE* fp = fopen(filename, "wb");
+   if ( fp == NULL ) {
+      std::cerr << "Failed to write " << filename << std::endl;
+      return false;
+   }
+
+   fprintf( fp, "P6\n%d %d\n255\n", width, height );
+   fwrite( rgb, 1, width * height * 3, fp );
+   return fclose(fp) == 0;
+}
+
+// Write the current framebuffer contents as a binary PPM
+static void
+write_frame(const char* prefix, int frame, int width, int height)
+{
+   std::vector<unsigned char> pixels( width * height * 3 );
+   glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+   glReadPixels( 0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0] );
+
+   // OpenGL rows start at the bottom of the image, PPM rows at the top
+   std::vector<unsigned char> rows( pixels.size() );
+   for ( int y = 0; y < height; ++y ) {
+      memcpy( &rows[y * width * 3], &pixels[(height - 1 - y) * width * 3], width * 3 );
+   }
+
+   char filename[1024];
+   snprintf( filename, sizeof(filename), "%s%04d.ppm", prefix, frame );
+   if ( !write_ppm( filename, width, height, &rows[0] ) ) {
+      exit( EXIT_FAILURE );
+   }
+}
+
+static void
+run_headless(void)
+{
+   int frames = option_value( "--frames" ) ? atoi( option_value( "--frames" ) ) : 300;
+   const char* dump_prefix = option_value( "--dump" );
+
+   reshape( OFFSCREEN_WIDTH, OFFSCREEN_HEIGHT );
+
+   for ( int frame = 0; replaying || frame < frames; ++frame ) {
+      advance_frame();
+      display_frame();
+      if ( dump_prefix != NULL ) {
+         write_frame( dump_prefix, frame, OFFSCREEN_WIDTH, OFFSCREEN_HEIGHT );
+      }
+      if ( replay_done() ) { break; }
+   }
+
+   // A replay's statistics come from the atexit handler
+   if ( !replaying ) { print_frame_stats(); }
+}
+
+//----------------------------------------------------------------------------
+
 void
 timer(int unused)
 {
-   update();
+   advance_frame();
    glutPostRedisplay();
    glutTimerFunc( FRAME_RATE_MS, timer, 0 );
 }
@@ -107,21 +484,66 @@ timer(int unused)
 int
 main( int argc, char **argv )
 {
-   glutInit( &argc, argv );
-   glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
-   glutInitWindowSize( 640, 640 );
-   glutInitContextVersion( 3, 2 );
-   glutInitContextProfile( GLUT_CORE_PROFILE );
-   glutCreateWindow( WINDOW_TITLE );
+   option_count = argc;
+   options = argv;
+   headless = has_option( "--headless" );
+
+   if ( run_without_gl() ) {
+      return 0;
+   }
+
+#ifdef __linux__
+   if ( headless ) {
+      if ( !create_egl_context() ) {
+         std::cerr << "Failed to create an offscreen EGL context" << std::endl;
+         exit( EXIT_FAILURE );
+      }
+   }
+   else
+#endif  // __linux__
+   {
+      glutInit( &argc, argv );
+      option_count = argc;
+      glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
+      glutInitWindowSize( 640, 640 );
+      glutInitContextVersion( 3, 2 );
+      glutInitContextProfile( GLUT_CORE_PROFILE );
+      glutCreateWindow( WINDOW_TITLE );
+      if ( headless ) { glutHideWindow(); }
+   }
 
+   glewExperimental = GL_TRUE;
    glewInit();
 
+   if ( headless ) {
+      create_framebuffer( OFFSCREEN_WIDTH, OFFSCREEN_HEIGHT );
+   }
+
    init();
 
-   glutDisplayFunc( display );
-   glutKeyboardFunc( keyboard );
-   glutMouseFunc( mouse );
-   glutReshapeFunc( reshape );
+   if ( option_value( "--record" ) != NULL ) {
+      record_file = fopen( option_value( "--record" ), "w" );
+      if ( record_file == NULL ) {
+         std::cerr << "Failed to open " << option_value( "--record" ) << std::endl;
+         exit( EXIT_FAILURE );
+      }
+      fprintf( record_file, "# frame time_ms type args...\n" );
+   }
+   if ( option_value( "--replay" ) != NULL ) {
+      load_replay( option_value( "--replay" ) );
+      atexit( print_frame_stats );
+   }
+
+   if ( headless ) {
+      run_headless();
+      return 0;
+   }
+
+   glutDisplayFunc( display_frame );
+   glutKeyboardFunc( keyboard_input );
+   glutMouseFunc( mouse_input );
+   glutMotionFunc( motion_input );
+   glutReshapeFunc( reshape_input );
    glutTimerFunc( FRAME_RATE_MS, timer, 0 );
    
    glutMainLoop();
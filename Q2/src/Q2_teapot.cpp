@@ -1,7 +1,25 @@
 
 #include "common.h"
+#include "bezier_patch.h"
+#include "patch_mesh.h"
+#include "patch_file.h"
+#include "patch_batch.h"
+#include "worker_pool.h"
+#include "patch_bvh.h"
+#include "ray_patch.h"
+#include "soft_render.h"
+#include "stream_buffer.h"
+#include "patch_subdivide.h"
+#include "mesh_export.h"
+#include "model_loader.h"
+#include "patch_chunks.h"
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -10,14 +28,29 @@
 const char *WINDOW_TITLE = "Teaset";
 const double FRAME_RATE_MS = 1000.0/60.0;
 
-typedef glm::vec4  color4;
-typedef glm::vec4  point4;
-typedef glm::vec3  point3;
-typedef glm::vec2  point2;
-
-const int num_increments = 8;
 bool show_control_points = false;
 
+// What the model is drawn as, cycled with the M key
+enum { LinesMode = 0, ImmediateMode = 1, MeshMode = 2, ShadedMode = 3, GpuMode = 4, TessMode = 5, AdaptiveMode = 6, ParallelMode = 7, InstancedMode = 8, SubdividedMode = 9, NumRenderModes = 10 };
+const char *render_mode_names[NumRenderModes] = { "lines", "immediate", "mesh", "shaded", "gpu", "tess", "adaptive", "parallel", "instanced", "subdivided" };
+int render_mode = LinesMode;
+
+// Hardware tessellation needs OpenGL 4.0; the other modes only need 3.2
+bool tessellation_supported = false;
+const float pixels_per_segment = 8.0;
+// How far the subdivided mode's triangles may be from the surface at zoom 1,
+// in model units, --tolerance <t>. About half a pixel in the starting view.
+float chord_tolerance = 0.01;
+float zoom = 1.0;
+int window_width = 640, window_height = 640;
+bool culling = true;
+bool back_culling = true;
+// Copies of the model the instanced mode draws, --instances <n>
+int num_instances = 1024;
+
+// Threads for tessellation, --threads <n> (default one per hardware thread)
+WorkerPool workers;
+
 glm::mat4 M = glm::mat4(
 	-1.0, 3.0, -3.0, 1.0,
 	3.0, -6.0, 3.0, 0.0,
@@ -31,132 +64,1344 @@ enum { Xaxis = 0, Yaxis = 1, Zaxis = 2, NumAxes = 3 };
 int      Axis = Zaxis;
 GLfloat  Theta[NumAxes] = { -45.0, 0.0, 0.0 };
 
-GLuint  ModelView, Projection;
+GLuint  program, ModelView, Projection;
+GLuint  vPosition;
+GLuint  dynamic_vao, dynamic_buffer;
+glm::mat4 model_view, projection;
+
+// Lit triangles use their own program with its own locations
+struct ShadedProgram {
+	GLuint program, ModelView, Projection;
+	GLuint vPosition, vNormal;
+} shaded;
+
+// Evaluates the patches in the vertex shader from a grid of (u,v)
+struct PatchEvalProgram {
+	GLuint program, ModelView, Projection, Patches, Visible;
+	GLuint vUV;
+} gpu_eval;
+
+// Bicubic evaluation in tessellation shaders, from raw 16-point patches
+struct TessProgram {
+	GLuint program, ModelView, Projection, Viewport, PixelsPerSegment;
+	GLuint vPosition;
+} tess;
+
+// The shaded mesh again, once per instance of an attribute of model matrices
+struct InstancedProgram {
+	GLuint program, ModelView, Projection;
+	GLuint vPosition, vNormal, vInstance;
+} instanced;
 
 
-class PatchIndex {
+PatchFile patch_file;
+std::vector<PatchIndex> patch_indices;
+// The control points as edited, starting from the file's, and the patches
+// that use each one
+std::vector<point3> loaded_points;
+PointPatches point_patches;
+// The control point the X, Y and Z keys move, chosen with P
+int selected_point = -1;
+const float edit_step = 0.1;
+
+// Create a vertex array object drawing vPosition from a new static buffer
+GLuint make_static_vao(const std::vector<point4> &data, GLuint *buffer) {
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	glGenBuffers(1, buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, *buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(point4)*data.size(), &data[0], GL_STATIC_DRAW);
+	glEnableVertexAttribArray(vPosition);
+	glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+	return vao;
+}
+
+// Step an attribute once per instance rather than once per vertex. It is core
+// from OpenGL 3.3; the 3.2 context asked for may only have it as
+// ARB_instanced_arrays.
+void set_instance_divisor(GLuint index) {
+	if (glVertexAttribDivisor)
+		glVertexAttribDivisor(index, 1);
+	else
+		glVertexAttribDivisorARB(index, 1);
+}
+
+// n copies of a model with the given bounds, shrunk and laid out on a square
+// grid across its xy plane so that all together they fill about the space
+// the model alone did, each turned about z by its own angle
+void make_instance_grid(int n, const Bounds &bounds, std::vector<glm::mat4> &instances) {
+	int side = int(ceil(sqrt(double(n))));
+	point3 extent = bounds.hi - bounds.lo;
+	float spacing = 1.1f * std::max(extent.x, extent.y);
+	point3 center = bounds.center();
+	instances.resize(n);
+	for (int i = 0; i < n; i++) {
+		glm::vec3 offset((i % side - 0.5f * (side - 1)) * spacing, (i / side - 0.5f * (side - 1)) * spacing, 0.0);
+		glm::mat4 m = glm::translate(glm::mat4(), center);
+		m = glm::scale(m, glm::vec3(1.0f / side));
+		m = glm::translate(m, offset);
+		m = glm::rotate(m, 2.4f * i, glm::vec3(0.0, 0.0, 1.0)); // the golden angle, so no two neighbours match
+		instances[i] = glm::translate(m, -center);
+	}
+}
+
+class BezierPatchCollection {
+	std::vector<BezierPatch> patches;
+	PatchMatrices matrices; // the same patches' MGMs, for batched grid evaluation
+	GLuint lines_vao, lines_buffer;
+	GLuint cps_vao, cps_buffer;
+	GLuint mesh_vao, mesh_buffer, mesh_index_buffer;
+	GLuint shaded_vao, normal_buffer;
+	GLuint matrix_buffer, matrix_texture;
+	GLuint grid_vao, grid_buffer, grid_index_buffer;
+	int num_grid_indices;
+	GLuint control_vao, control_buffer;
+	TriangleMesh adaptive_mesh, grid_mesh, subdivided_mesh;
+	GLuint streamed_vao, streamed_lines_vao;
+	StreamBuffer vertex_ring, index_ring, line_ring;
+	std::vector<GLint> immediate_firsts;
+	std::vector<GLsizei> immediate_counts;
+	int num_cps;
+	TriangleMesh mesh;
+
+	// Patches in view this frame, and the parts of the static buffers that
+	// draw them
+	PatchBVH bvh;
+	PatchRayCaster caster;
+	std::vector<NormalCone> cones;
+	float orientation; // 1 if Su x Sv points out of the model, -1 if in
+	std::vector<int> visible;
+	CullStats cull_stats;
+	std::vector<GLint> strip_firsts, control_firsts;
+	std::vector<GLsizei> strip_counts, control_counts, mesh_counts;
+	std::vector<const GLvoid *> mesh_offsets;
+	GLuint visible_buffer, visible_texture;
+	GLuint instanced_vao, instance_buffer;
+	std::vector<glm::mat4> instances;
+	GLuint loading_vao, loading_buffer;
+	int loaded_patches;
 public:
-	std::vector<int> cp_idxs;
-	PatchIndex(std::vector<int> cp_idxs_) {
-		cp_idxs = cp_idxs_;
+	BezierPatchCollection() : loading_vao(0), loading_buffer(0), loaded_patches(0) {}
+	// Take over a model built by PatchModel::build, off the render thread
+	// when it loaded in the background, and upload it. The geometry never
+	// changes, so every patch's lines go once into a single static buffer
+	// and all of its line strips draw with one call.
+	void build(PatchModel &model) {
+		patches.swap(model.patches);
+		std::swap(matrices, model.matrices);
+		std::swap(bvh, model.bvh);
+		std::swap(caster, model.caster);
+		caster.rebind(patches, bvh);
+		cones.swap(model.cones);
+		std::swap(mesh, model.mesh);
+		orientation = model.orientation;
+		lines_vao = make_static_vao(model.lines, &lines_buffer);
+
+		std::vector<point4> cps;
+		for (int i = 0; i < loaded_points.size(); i++)
+			cps.push_back(point4(loaded_points[i], 1.0));
+		num_cps = cps.size();
+		cps_vao = make_static_vao(cps, &cps_buffer);
+
+		std::cout << "Welded mesh: " << mesh.positions.size() << " vertices ("
+			<< patches.size() * num_increments * num_increments << " without welding), "
+			<< mesh.indices.size() / 3 << " triangles, " << (mesh.closed ? "closed" : "open") << "\n";
+
+		glGenVertexArrays(1, &mesh_vao);
+		glBindVertexArray(mesh_vao);
+		glGenBuffers(1, &mesh_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point3)*mesh.positions.size(), &mesh.positions[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(vPosition);
+		glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glGenBuffers(1, &mesh_index_buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_index_buffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*mesh.indices.size(), &mesh.indices[0], GL_STATIC_DRAW);
+
+		// Same positions and indices, plus normals, for the shaded program
+		glGenVertexArrays(1, &shaded_vao);
+		glBindVertexArray(shaded_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+		glEnableVertexAttribArray(shaded.vPosition);
+		glVertexAttribPointer(shaded.vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glGenBuffers(1, &normal_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point3)*mesh.normals.size(), &mesh.normals[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(shaded.vNormal);
+		glVertexAttribPointer(shaded.vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_index_buffer);
+
+		build_gpu_eval();
+		build_instanced();
+		build_streamed();
+		if (tessellation_supported)
+			build_tess();
 	}
-};
-std::vector<point3> loaded_points;
-std::vector<PatchIndex> patch_indices;
-void load_patch(char *filename, int *patches, int *verticies)
-{
-	int ii;
-	float x, y, z;
-	int a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p;
+	// The welded mesh's buffers again, plus a buffer of model matrices that
+	// advances once per instance, one vec4 column per attribute location
+	void build_instanced() {
+		glGenVertexArrays(1, &instanced_vao);
+		glBindVertexArray(instanced_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+		glEnableVertexAttribArray(instanced.vPosition);
+		glVertexAttribPointer(instanced.vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
+		glEnableVertexAttribArray(instanced.vNormal);
+		glVertexAttribPointer(instanced.vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glGenBuffers(1, &instance_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		for (int column = 0; column < 4; column++) {
+			glEnableVertexAttribArray(instanced.vInstance + column);
+			glVertexAttribPointer(instanced.vInstance + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), BUFFER_OFFSET(sizeof(glm::vec4) * column));
+			set_instance_divisor(instanced.vInstance + column);
+		}
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_index_buffer);
+	}
+	// After loaded_points[point] has moved, rebuild only the patches that use
+	// it and rewrite only their parts of the static buffers. The modes that
+	// tessellate every frame pick the new patches up by themselves. Returns
+	// how many mesh vertices changed.
+	int move_point(int point) {
+		int changed = 0;
+		for (const int *p = point_patches.begin(point); p != point_patches.end(point); p++) {
+			int i = *p;
+			point3 cps[16];
+			for (int j = 0; j < 16; j++)
+				cps[j] = loaded_points[patch_indices[i].cp_idxs[j] - 1];
+			patches[i] = BezierPatch(cps);
+			matrices.set_matrix(i, 0, patches[i].MGM_x);
+			matrices.set_matrix(i, 1, patches[i].MGM_y);
+			matrices.set_matrix(i, 2, patches[i].MGM_z);
+			cones[i] = NormalCone(patches[i]);
+			caster.update_patch(i);
 
-	FILE *fp;
+			point4 lines[BezierPatch::num_line_vertices];
+			patches[i].tessellate(lines);
+			glBindBuffer(GL_ARRAY_BUFFER, lines_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(lines) * i, sizeof(lines), lines);
 
-	if (!(fp = fopen(filename, "r"))) {
-		fprintf(stderr, "Load_patch: Can't open %s\n", filename);
-		exit(1);
+			glm::mat4 patch_mgm[3] = { patches[i].MGM_x, patches[i].MGM_y, patches[i].MGM_z };
+			glBindBuffer(GL_TEXTURE_BUFFER, matrix_buffer);
+			glBufferSubData(GL_TEXTURE_BUFFER, sizeof(patch_mgm) * i, sizeof(patch_mgm), patch_mgm);
+
+			if (tessellation_supported) {
+				glBindBuffer(GL_ARRAY_BUFFER, control_buffer);
+				glBufferSubData(GL_ARRAY_BUFFER, sizeof(patches[i].cps) * i, sizeof(patches[i].cps), patches[i].cps);
+			}
+			// The vertices a patch added to the welded mesh are numbered
+			// together, so they are one range of each buffer
+			update_welded_patch(patches, i, num_increments, mesh);
+			GLuint first = mesh.patch_vertex_starts[i], count = mesh.patch_vertex_starts[i + 1] - first;
+			glBindBuffer(GL_ARRAY_BUFFER, mesh_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(point3) * first, sizeof(point3) * count, &mesh.positions[first]);
+			glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(point3) * first, sizeof(point3) * count, &mesh.normals[first]);
+			changed += count;
+		}
+		bvh.refit(patches);
+
+		point4 cp(loaded_points[point], 1.0);
+		glBindBuffer(GL_ARRAY_BUFFER, cps_buffer);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(point4) * point, sizeof(point4), &cp);
+		return changed;
 	}
+	// Replace the instances the instanced mode draws
+	void set_instances(const std::vector<glm::mat4> &instances_) {
+		instances = instances_;
+		glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(glm::mat4)*instances.size(), instances.empty() ? NULL : &instances[0], GL_STATIC_DRAW);
+	}
+	const Bounds &bounds() const {
+		return bvh.bounds();
+	}
+	// Ring buffers for the geometry that is rebuilt every frame: the meshes
+	// of the adaptive and parallel modes, and the lines of the immediate mode.
+	// Each starts with room for the welded mesh or every patch's lines and
+	// grows if a frame needs more.
+	void build_streamed() {
+		glGenVertexArrays(1, &streamed_vao);
+		glBindVertexArray(streamed_vao);
+		vertex_ring.create(sizeof(point3) * (mesh.positions.size() + mesh.normals.size()));
+		index_ring.create(sizeof(GLuint) * mesh.indices.size());
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_ring.id());
+		glEnableVertexAttribArray(shaded.vPosition);
+		glEnableVertexAttribArray(shaded.vNormal);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_ring.id());
 
-	(void)fscanf(fp, "%i\n", patches);
-	for (ii = 0; ii < *patches; ii++) {
-		(void)fscanf(fp, "%i, %i, %i, %i,", &a, &b, &c, &d);
-		(void)fscanf(fp, "%i, %i, %i, %i,", &e, &f, &g, &h);
-		(void)fscanf(fp, "%i, %i, %i, %i,", &i, &j, &k, &l);
-		(void)fscanf(fp, "%i, %i, %i, %i\n", &m, &n, &o, &p);
-		std::vector<int> cp_indices({ a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p });
-		patch_indices.push_back(PatchIndex(cp_indices));
+		glGenVertexArrays(1, &streamed_lines_vao);
+		glBindVertexArray(streamed_lines_vao);
+		line_ring.create(sizeof(point4) * BezierPatch::num_line_vertices * patches.size());
+		glBindBuffer(GL_ARRAY_BUFFER, line_ring.id());
+		glEnableVertexAttribArray(vPosition);
+		glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
 	}
-	(void)fscanf(fp, "%i\n", verticies);
-	for (ii = 1; ii <= *verticies; ii++) {
-		(void)fscanf(fp, "%f, %f, %f\n", &x, &y, &z);
-		loaded_points.push_back(point3(x, y, z));
+	// Every patch's 16 control points, in order, for drawing as GL_PATCHES
+	void build_tess() {
+		std::vector<point3> control;
+		for (int i = 0; i < patches.size(); i++)
+			control.insert(control.end(), patches[i].cps, patches[i].cps + 16);
+
+		glGenVertexArrays(1, &control_vao);
+		glBindVertexArray(control_vao);
+		glGenBuffers(1, &control_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, control_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point3)*control.size(), &control[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(tess.vPosition);
+		glVertexAttribPointer(tess.vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
 	}
-}
+	// Upload every patch's MGM matrices once into a texture buffer, along with
+	// a single (u,v) grid that the vertex shader evaluates once per patch. A
+	// second texture buffer, refilled each frame, maps instances to patches.
+	void build_gpu_eval() {
+		std::vector<glm::mat4> matrices;
+		for (int i = 0; i < patches.size(); i++) {
+			matrices.push_back(patches[i].MGM_x);
+			matrices.push_back(patches[i].MGM_y);
+			matrices.push_back(patches[i].MGM_z);
+		}
+		glGenBuffers(1, &matrix_buffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, matrix_buffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::mat4)*matrices.size(), &matrices[0], GL_STATIC_DRAW);
+		glGenTextures(1, &matrix_texture);
+		glBindTexture(GL_TEXTURE_BUFFER, matrix_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, matrix_buffer);
+		glGenBuffers(1, &visible_buffer);
+		glGenTextures(1, &visible_texture);
 
-class BezierPatch {
-public:
-	glm::mat4 MGM_x, MGM_y, MGM_z;
-	point4 line_vertices[num_increments * 2];
-	BezierPatch(point3 *cps_) {
-		MGM_x = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 0));
-		MGM_y = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 1));
-		MGM_z = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 2));
-	}
-	glm::mat4 construct_MGM(float slice[16]) {
-		glm::mat4 G = transpose(glm::make_mat4(slice));
-		return M * G * transpose(M);
-	}
-	float *get_slice(point3 *arr, int j) {
-		float *slice = new float[16];
-		for (int i = 0; i < 16; i++)
-			slice[i] = arr[i][j];
-		return slice;
-	}
-	point4 patch_point(glm::mat4 MGM_x, glm::mat4 MGM_y, glm::mat4 MGM_z, float u, float v) {
-		point4 U = point4(u*u*u, u*u, u, 1.0);
-		point4 V = point4(v*v*v, v*v, v, 1.0);
-		return point4(dot(U, MGM_x * V), dot(U, MGM_y * V), dot(U, MGM_z * V), 1.0);
+		const int n = num_increments;
+		std::vector<point2> grid;
+		std::vector<GLuint> grid_indices;
+		for (int i = 0; i < n; i++)
+			for (int j = 0; j < n; j++)
+				grid.push_back(point2(float(i) / (n - 1), float(j) / (n - 1)));
+		for (int i = 0; i < n - 1; i++) {
+			for (int j = 0; j < n - 1; j++) {
+				GLuint v00 = i * n + j, v10 = (i + 1) * n + j, v01 = i * n + j + 1, v11 = (i + 1) * n + j + 1;
+				GLuint cell[6] = { v00, v10, v11, v00, v11, v01 };
+				grid_indices.insert(grid_indices.end(), cell, cell + 6);
+			}
+		}
+		num_grid_indices = grid_indices.size();
+
+		glGenVertexArrays(1, &grid_vao);
+		glBindVertexArray(grid_vao);
+		glGenBuffers(1, &grid_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, grid_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point2)*grid.size(), &grid[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(gpu_eval.vUV);
+		glVertexAttribPointer(gpu_eval.vUV, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		glGenBuffers(1, &grid_index_buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, grid_index_buffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*grid_indices.size(), &grid_indices[0], GL_STATIC_DRAW);
+	}
+	// Find the patches in view, then the draw ranges covering them. A run of
+	// consecutive patches is one range, except for line strips, which each
+	// need their own. Drawing solid surfaces of a closed model, patches facing
+	// away from the eye are left out as well, since the ones facing it hide
+	// them. Through the open edges of a model they can show, so they are kept.
+	void cull(bool solid) {
+		visible.clear();
+		if (culling)
+			bvh.cull(Frustum(projection * model_view), visible, cull_stats);
+		else {
+			for (int i = 0; i < patches.size(); i++)
+				visible.push_back(i);
+			cull_stats = CullStats();
+			cull_stats.visible = patches.size();
+		}
+		if (solid && back_culling && mesh.closed) {
+			point3 eye = point3(inverse(model_view) * point4(0.0, 0.0, 0.0, 1.0));
+			int kept = 0;
+			for (int i = 0; i < visible.size(); i++)
+				if (!cones[visible[i]].back_facing(eye, orientation))
+					visible[kept++] = visible[i];
+			cull_stats.back_facing = visible.size() - kept;
+			cull_stats.visible = kept;
+			visible.resize(kept);
+		}
+
+		strip_firsts.clear();
+		strip_counts.clear();
+		control_firsts.clear();
+		control_counts.clear();
+		mesh_offsets.clear();
+		mesh_counts.clear();
+		for (int i = 0; i < visible.size(); i++) {
+			int p = visible[i];
+			for (int strip = 0; strip < 2 * num_increments; strip++) {
+				strip_firsts.push_back(p * BezierPatch::num_line_vertices + strip * num_increments);
+				strip_counts.push_back(num_increments);
+			}
+			bool run = i > 0 && visible[i - 1] == p - 1;
+			GLuint mesh_count = mesh.patch_starts[p + 1] - mesh.patch_starts[p];
+			if (run) {
+				control_counts.back() += 16;
+				mesh_counts.back() += mesh_count;
+			}
+			else {
+				control_firsts.push_back(16 * p);
+				control_counts.push_back(16);
+				mesh_offsets.push_back(BUFFER_OFFSET(sizeof(GLuint) * mesh.patch_starts[p]));
+				mesh_counts.push_back(mesh_count);
+			}
+		}
+	}
+	// A model loading in the background (see ModelLoader) arrives as batches
+	// of lines. Only those are drawn, from a buffer with room for the whole
+	// model, until the last batch brings the built model for build().
+	void begin_loading(int total) {
+		glGenVertexArrays(1, &loading_vao);
+		glBindVertexArray(loading_vao);
+		glGenBuffers(1, &loading_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, loading_buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(point4) * total * loading_line_vertices, NULL, GL_STATIC_DRAW);
+		glEnableVertexAttribArray(vPosition);
+		glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+	}
+	void add_batch(const PatchBatch &batch) {
+		glBindBuffer(GL_ARRAY_BUFFER, loading_buffer);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(point4) * batch.first * loading_line_vertices,
+			sizeof(point4) * batch.lines.size(), batch.lines.data());
+		loaded_patches += batch.count;
+	}
+	void draw_loading() {
+		if (loaded_patches == 0)
+			return;
+		glBindVertexArray(loading_vao);
+		glDrawArrays(GL_LINES, 0, loaded_patches * loading_line_vertices);
+	}
+	void end_loading() {
+		glDeleteBuffers(1, &loading_buffer);
+		glDeleteVertexArrays(1, &loading_vao);
+		loading_vao = loading_buffer = 0;
+	}
+	const CullStats &last_cull() const {
+		return cull_stats;
+	}
+	bool closed() const {
+		return mesh.closed;
+	}
+	const PatchRayCaster &ray_caster() const {
+		return caster;
+	}
+	const BezierPatch &patch(int i) const {
+		return patches[i];
 	}
 	void draw() {
-		for (int i = 0; i < num_increments; i++) {
-			for (int j = 0; j < num_increments; j++) {
-				float u = 1.0 / (num_increments - 1) * i;
-				float v = 1.0 / (num_increments - 1) * j;
+		cull(false);
+		glBindVertexArray(lines_vao);
+		glMultiDrawArrays(GL_LINE_STRIP, strip_firsts.data(), strip_counts.data(), strip_firsts.size());
+	}
+	void draw_mesh() {
+		cull(false);
+		glBindVertexArray(mesh_vao);
+		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		glMultiDrawElements(GL_TRIANGLES, mesh_counts.data(), GL_UNSIGNED_INT, mesh_offsets.data(), mesh_counts.size());
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	}
+	void draw_shaded() {
+		cull(true);
+		glUseProgram(shaded.program);
+		glUniformMatrix4fv(shaded.ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+		glBindVertexArray(shaded_vao);
+		glMultiDrawElements(GL_TRIANGLES, mesh_counts.data(), GL_UNSIGNED_INT, mesh_offsets.data(), mesh_counts.size());
+		glUseProgram(program);
+	}
+	// Every instance in one call, however many there are. The patches are
+	// not culled, as each instance would see them from its own side.
+	void draw_instanced() {
+		glUseProgram(instanced.program);
+		glUniformMatrix4fv(instanced.ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+		glBindVertexArray(instanced_vao);
+		glDrawElementsInstanced(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, BUFFER_OFFSET(0), instances.size());
+		glUseProgram(program);
+	}
+	// The same instances drawn the way it would take without instancing, one
+	// draw call each with its own model-view matrix, for comparison
+	void draw_instances_one_by_one() {
+		glUseProgram(shaded.program);
+		glBindVertexArray(shaded_vao);
+		for (int i = 0; i < instances.size(); i++) {
+			glUniformMatrix4fv(shaded.ModelView, 1, GL_FALSE, glm::value_ptr(model_view * instances[i]));
+			glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, BUFFER_OFFSET(0));
+		}
+		glUseProgram(program);
+	}
+	void draw_gpu() {
+		cull(true);
+		glUseProgram(gpu_eval.program);
+		glUniformMatrix4fv(gpu_eval.ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+		glBindTexture(GL_TEXTURE_BUFFER, matrix_texture);
+		glBindBuffer(GL_TEXTURE_BUFFER, visible_buffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(int)*std::max(visible.size(), size_t(1)), visible.empty() ? NULL : &visible[0], GL_STREAM_DRAW);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_BUFFER, visible_texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, visible_buffer);
+		glActiveTexture(GL_TEXTURE0);
+		glBindVertexArray(grid_vao);
+		glDrawElementsInstanced(GL_TRIANGLES, num_grid_indices, GL_UNSIGNED_INT, BUFFER_OFFSET(0), visible.size());
+		glUseProgram(program);
+	}
+	// Upload a mesh built this frame and draw it shaded. Positions and then
+	// normals go into one range of the vertex ring, and the attributes are
+	// pointed at wherever that range landed.
+	void draw_streamed(const TriangleMesh &mesh) {
+		GLsizeiptr position_bytes = sizeof(point3)*mesh.positions.size(), normal_bytes = sizeof(point3)*mesh.normals.size();
+		GLsizeiptr index_bytes = sizeof(GLuint)*mesh.indices.size();
+		GLintptr vertex_offset, index_offset;
+		char *vertices = (char *)vertex_ring.map(position_bytes + normal_bytes, vertex_offset);
+		if (vertices) {
+			memcpy(vertices, &mesh.positions[0], position_bytes);
+			memcpy(vertices + position_bytes, &mesh.normals[0], normal_bytes);
+		}
+		vertex_ring.unmap();
+		void *indices = index_ring.map(index_bytes, index_offset);
+		if (indices)
+			memcpy(indices, &mesh.indices[0], index_bytes);
+		index_ring.unmap();
 
-				line_vertices[j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, u, v);
-				line_vertices[num_increments+j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, v, u);
+		glBindVertexArray(streamed_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_ring.id());
+		glVertexAttribPointer(shaded.vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(vertex_offset));
+		glVertexAttribPointer(shaded.vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(vertex_offset + position_bytes));
+		glUseProgram(shaded.program);
+		glUniformMatrix4fv(shaded.ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+		glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, BUFFER_OFFSET(index_offset));
+		glUseProgram(program);
+		vertex_ring.end_frame();
+		index_ring.end_frame();
+	}
+	// Re-tessellate for the current view and draw the result shaded
+	void draw_adaptive() {
+		cull(true);
+		build_adaptive_mesh(patches, patch_indices, visible, projection * model_view,
+			glm::vec2(window_width, window_height), pixels_per_segment, adaptive_mesh);
+		draw_streamed(adaptive_mesh);
+	}
+	// Re-tessellate every patch into a grid as fine as the zoom asks for,
+	// spread over the worker threads, and draw the result shaded
+	void draw_parallel() {
+		cull(true);
+		int n = std::min(std::max(int(num_increments * zoom + 0.5), 2), 64);
+		build_grid_mesh(workers, matrices, patches, visible, n, grid_mesh);
+		draw_streamed(grid_mesh);
+	}
+	int adaptive_triangles() {
+		return adaptive_mesh.indices.size() / 3;
+	}
+	// Split each patch until it is flat to within a tolerance that shrinks as
+	// the zoom grows, so the error stays about the same on screen, and draw
+	// the result shaded
+	void draw_subdivided() {
+		cull(true);
+		build_subdivided_mesh(patches, patch_indices, visible, chord_tolerance / zoom, subdivided_mesh);
+		draw_streamed(subdivided_mesh);
+	}
+	int subdivided_triangles() {
+		return subdivided_mesh.indices.size() / 3;
+	}
+	void draw_tess() {
+		cull(true);
+		glUseProgram(tess.program);
+		glUniformMatrix4fv(tess.ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+		glBindVertexArray(control_vao);
+		glPatchParameteri(GL_PATCH_VERTICES, 16);
+		glMultiDrawArrays(GL_PATCHES, control_firsts.data(), control_counts.data(), control_firsts.size());
+		glUseProgram(program);
+	}
+	// Evaluate every patch's lines again each frame, as the original path
+	// did, but straight into this frame's range of the line ring, and draw
+	// all of their strips with one call
+	void draw_immediate() {
+		cull(false);
+		GLintptr offset;
+		point4 *lines = (point4 *)line_ring.map(sizeof(point4) * BezierPatch::num_line_vertices * visible.size(), offset);
+		GLint base = offset / sizeof(point4);
+		immediate_firsts.clear();
+		immediate_counts.clear();
+		for (int i = 0; i < visible.size(); i++) {
+			patches[visible[i]].tessellate(&lines[i * BezierPatch::num_line_vertices]);
+			for (int strip = 0; strip < 2 * num_increments; strip++) {
+				immediate_firsts.push_back(base + i * BezierPatch::num_line_vertices + strip * num_increments);
+				immediate_counts.push_back(num_increments);
 			}
-			glBufferData(GL_ARRAY_BUFFER, sizeof(line_vertices), line_vertices, GL_STATIC_DRAW);
-			glDrawArrays(GL_LINE_STRIP, 0, num_increments);
-			glDrawArrays(GL_LINE_STRIP, num_increments, num_increments);
+		}
+		line_ring.unmap();
+
+		glBindVertexArray(streamed_lines_vao);
+		glMultiDrawArrays(GL_LINE_STRIP, immediate_firsts.data(), immediate_counts.data(), immediate_firsts.size());
+		line_ring.end_frame();
+	}
+	// The original path itself: every patch row by row, each row uploaded
+	// with glBufferData and drawn with two calls. Kept for the benchmark.
+	void draw_immediate_rows() {
+		cull(false);
+		glBindVertexArray(dynamic_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, dynamic_buffer);
+		for (int i = 0; i < visible.size(); i++) {
+			patches[visible[i]].draw();
 		}
 	}
+	void draw_cps() {
+		glBindVertexArray(cps_vao);
+		glDrawArrays(GL_POINTS, 0, num_cps);
+	}
 };
+BezierPatchCollection patches;
 
-class BezierPatchCollection {
-	std::vector<BezierPatch> patches;
+// --chunked <file> draws a model written by --chunk out of core. Only the
+// chunks in view are read and tessellated, into a cache holding at most
+// --budget <MB> of lines (default 256), and each frame the cached lines in
+// view stream through a line ring as the immediate mode's do. It draws lines
+// alone, since every other mode needs the whole model in memory.
+class OutOfCoreModel {
+	ChunkedPatchFile file;
+	PatchChunkCache cache;
+	StreamBuffer ring;
+	GLuint vao;
+	std::vector<const PatchChunkCache::Resident *> visible;
+	std::vector<GLint> firsts;
+	std::vector<GLsizei> counts;
 public:
-	BezierPatchCollection() {}
-	void add_patch(BezierPatch patch) {
-		patches.push_back(patch);
+	OutOfCoreModel() : vao(0) {}
+	bool open(const char *filename, size_t budget) {
+		if (!file.open(filename))
+			return false;
+		cache.open(file, budget);
+		std::cout << "Opened " << file.num_patches() << " patches in " << file.chunks().size() << " chunks from "
+			<< filename << ", caching up to " << budget / 1048576.0 << " MB of lines\n";
+
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		ring.create(std::min(budget, size_t(16) << 20));
+		glBindBuffer(GL_ARRAY_BUFFER, ring.id());
+		glEnableVertexAttribArray(vPosition);
+		glVertexAttribPointer(vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		return true;
+	}
+	const PatchChunkCache &chunk_cache() const {
+		return cache;
 	}
 	void draw() {
-		for (int i = 0; i < patches.size(); i++) {
-			patches[i].draw();
+		point3 eye = point3(inverse(model_view) * point4(0.0, 0.0, 0.0, 1.0));
+		cache.gather(Frustum(projection * model_view), eye, visible);
+		size_t vertices = 0;
+		for (int i = 0; i < visible.size(); i++)
+			vertices += visible[i]->lines.size();
+
+		GLintptr offset;
+		point4 *lines = (point4 *)ring.map(sizeof(point4) * vertices, offset);
+		GLint first = offset / sizeof(point4);
+		firsts.clear();
+		counts.clear();
+		for (int i = 0; i < visible.size(); i++) {
+			const std::vector<point4> &chunk_lines = visible[i]->lines;
+			std::copy(chunk_lines.begin(), chunk_lines.end(), lines);
+			lines += chunk_lines.size();
+			for (int strip = 0; strip < chunk_lines.size(); strip += num_increments) {
+				firsts.push_back(first + strip);
+				counts.push_back(num_increments);
+			}
+			first += chunk_lines.size();
 		}
-	}
-	void draw_cps() {
-		std::vector<point4> to_draw;
-		for (int i = 0; i < loaded_points.size(); i++)
-			to_draw.push_back(point4(loaded_points[i], 1.0));
+		ring.unmap();
 
-		glBufferData(GL_ARRAY_BUFFER, sizeof(point4)*to_draw.size(), &to_draw[0], GL_STATIC_DRAW);
-		glDrawArrays(GL_POINTS, 0, to_draw.size());
+		glBindVertexArray(vao);
+		glMultiDrawArrays(GL_LINE_STRIP, firsts.data(), counts.data(), firsts.size());
+		ring.end_frame();
 	}
 };
-BezierPatchCollection patches;
+OutOfCoreModel out_of_core_model;
+bool out_of_core = false;
 
 //----------------------------------------------------------------------------
 
+// The projection for a window of the given shape
+glm::mat4 projection_matrix(int width, int height) {
+	GLfloat aspect = GLfloat(width) / height;
+	return glm::perspective(glm::radians(45.0f), aspect, 0.5f, 3.0f);
+}
+
+//  Generate the model-view matrix
+glm::mat4 model_view_matrix() {
+	const glm::vec3 viewer_pos(0.0, 0.0, 2.0);
+	glm::mat4 view_trans, trans, rot, scale;
+	rot = glm::rotate(rot, glm::radians(Theta[Xaxis]), glm::vec3(1, 0, 0));
+	rot = glm::rotate(rot, glm::radians(Theta[Yaxis]), glm::vec3(0, 1, 0));
+	rot = glm::rotate(rot, glm::radians(Theta[Zaxis]), glm::vec3(0, 0, 1));
+	view_trans = glm::translate(view_trans, -viewer_pos);
+	scale = glm::scale(scale, glm::vec3(0.18, 0.18, 0.18) * zoom);
+	trans = glm::translate(trans, glm::vec3(0.0, 0.0, -0.7));
+	return view_trans * scale * rot * trans;
+}
+
+// The ray from the eye through the middle of pixel (x, y) of a width x height
+// view, with y counted down from the top as GLUT does. t is 0 on the near
+// plane and 1 on the far one.
+Ray pixel_ray(const glm::mat4 &inverse_model_view_projection, int x, int y, int width, int height) {
+	float ndc_x = 2.0f * (x + 0.5f) / width - 1.0f;
+	float ndc_y = 1.0f - 2.0f * (y + 0.5f) / height;
+	point4 near_point = inverse_model_view_projection * point4(ndc_x, ndc_y, -1.0, 1.0);
+	point4 far_point = inverse_model_view_projection * point4(ndc_x, ndc_y, 1.0, 1.0);
+	Ray ray;
+	ray.origin = point3(near_point) / near_point.w;
+	ray.direction = point3(far_point) / far_point.w - ray.origin;
+	return ray;
+}
+
+// The colour fshader_shaded.glsl gives a ray's hit, or the background for a
+// miss
+void shade_hit(const RayHit &hit, unsigned char *rgb) {
+	if (hit.patch < 0) {
+		rgb[0] = rgb[1] = rgb[2] = 255;
+		return;
+	}
+	point3 position, normal;
+	patches.patch(hit.patch).patch_point_normal(hit.u, hit.v, position, normal);
+	point3 N = normalize(point3(model_view * point4(normal, 0.0)));
+	point3 eye_position = point3(model_view * point4(position, 1.0));
+	if (dot(N, eye_position) > 0.0)
+		N = -N;
+	point3 color = shaded_color(N, eye_position);
+	for (int k = 0; k < 3; k++)
+		rgb[k] = (unsigned char)(std::min(color[k], 1.0f) * 255.0f + 0.5f);
+}
+
+// Ray-cast the current view into rgb, top row first, in square tiles that
+// are one packet each (or one ray at a time) shared out over the pool
+const int ray_tile = 8;
+void ray_cast_view(WorkerPool &pool, int width, int height, bool packets, std::vector<unsigned char> &rgb) {
+	rgb.resize(size_t(width) * height * 3);
+	glm::mat4 inverse_model_view_projection = inverse(projection * model_view);
+	const PatchRayCaster &caster = patches.ray_caster();
+	int tiles_across = (width + ray_tile - 1) / ray_tile;
+	int tiles_down = (height + ray_tile - 1) / ray_tile;
+	pool.parallel_for(0, tiles_across * tiles_down, 4, [&](int first, int last) {
+		Ray rays[ray_tile * ray_tile];
+		RayHit hits[ray_tile * ray_tile];
+		for (int tile = first; tile < last; tile++) {
+			int x0 = tile % tiles_across * ray_tile, x1 = std::min(x0 + ray_tile, width);
+			int y0 = tile / tiles_across * ray_tile, y1 = std::min(y0 + ray_tile, height);
+			int count = 0;
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					rays[count] = pixel_ray(inverse_model_view_projection, x, y, width, height);
+					hits[count] = RayHit();
+					hits[count].t = 1.0; // nothing past the far plane, as when drawn
+					count++;
+				}
+			}
+			if (packets)
+				caster.intersect_packet(rays, count, hits);
+			else
+				for (int i = 0; i < count; i++)
+					caster.intersect(rays[i], hits[i]);
+			count = 0;
+			for (int y = y0; y < y1; y++)
+				for (int x = x0; x < x1; x++)
+					shade_hit(hits[count++], &rgb[3 * (size_t(y) * width + x)]);
+		}
+	});
+}
+
+// Print which patch, and where on it, is under pixel (x, y) of the window
+void pick(int x, int y) {
+	Ray ray = pixel_ray(inverse(projection * model_view_matrix()), x, y, window_width, window_height);
+	RayHit hit;
+	hit.t = 1.0;
+	if (!patches.ray_caster().intersect(ray, hit)) {
+		std::cout << "Nothing at (" << x << ", " << y << ")\n";
+		return;
+	}
+	point3 position, normal;
+	patches.patch(hit.patch).patch_point_normal(hit.u, hit.v, position, normal);
+	std::cout << "Patch " << hit.patch << " at (" << x << ", " << y << "): u " << hit.u << ", v " << hit.v
+		<< ", point (" << position.x << ", " << position.y << ", " << position.z << ")\n";
+
+	// Its nearest control point becomes the one to edit
+	float nearest = 1e30f;
+	for (int j = 0; j < 16; j++) {
+		int point = patch_indices[hit.patch].cp_idxs[j] - 1;
+		if (distance(loaded_points[point], position) < nearest) {
+			nearest = distance(loaded_points[point], position);
+			selected_point = point;
+		}
+	}
+	std::cout << "Selected control point " << selected_point + 1 << ", used by " << point_patches.count(selected_point) << " patches\n";
+}
+
+// Move the selected control point and update what depends on it
+void move_selected_point(const point3 &offset) {
+	if (selected_point < 0) {
+		std::cout << "Pick a control point with P first\n";
+		return;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	loaded_points[selected_point] += offset;
+	int vertices = patches.move_point(selected_point);
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	const point3 &p = loaded_points[selected_point];
+	std::cout << "Control point " << selected_point + 1 << " now at (" << p.x << ", " << p.y << ", " << p.z << "): rebuilt "
+		<< point_patches.count(selected_point) << " patches and " << vertices << " mesh vertices in " << elapsed.count() << " ms\n";
+}
+
+// Mean time in ms to clear and draw the model, including the GPU finishing
+double time_draws(void (BezierPatchCollection::*draw)(), int frames) {
+	glFinish();
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < frames; i++) {
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		(patches.*draw)();
+	}
+	glFinish();
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+	return elapsed.count() / frames;
+}
+
+// A large model for the benchmarks: n patches cycling through the loaded
+// model's, over 1024 displaced copies of its points so that the gathers don't
+// all hit the same few cache lines
+void make_synthetic_model(int n, std::vector<point3> &points, std::vector<PatchIndex> &indices) {
+	const int copies = 1024;
+	points.clear();
+	for (int c = 0; c < copies; c++)
+		for (int i = 0; i < patch_file.num_points; i++)
+			points.push_back(patch_file.points[i] + point3(c % 32, c / 32, 0.0));
+	indices.resize(n);
+	for (int i = 0; i < n; i++) {
+		int model_patch = i % patch_indices.size();
+		int offset = (i / patch_indices.size()) % copies * patch_file.num_points;
+		for (int j = 0; j < 16; j++)
+			indices[i].cp_idxs[j] = patch_indices[model_patch].cp_idxs[j] + offset;
+	}
+}
+
+// Build the matrices of n synthetic patches both one BezierPatch at a time and
+// in one batch
+void benchmark_matrices(int n) {
+	std::vector<point3> points;
+	std::vector<PatchIndex> indices;
+	make_synthetic_model(n, points, indices);
+
+	PatchMatrices batch;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	build_patch_matrices(&points[0], &indices[0], n, batch);
+	std::chrono::duration<double, std::milli> batch_time = std::chrono::steady_clock::now() - start;
+	start = std::chrono::steady_clock::now();
+	build_patch_matrices(&points[0], &indices[0], n, batch);
+	std::chrono::duration<double, std::milli> rebuild_time = std::chrono::steady_clock::now() - start;
+
+	// The same matrices kept one patch after another, as BezierPatch does
+	std::vector<glm::mat4> separate(3 * size_t(n));
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < n; i++) {
+		point3 cps[16];
+		for (int j = 0; j < 16; j++)
+			cps[j] = points[indices[i].cp_idxs[j] - 1];
+		BezierPatch patch(cps);
+		separate[3 * i] = patch.MGM_x;
+		separate[3 * i + 1] = patch.MGM_y;
+		separate[3 * i + 2] = patch.MGM_z;
+	}
+	std::chrono::duration<double, std::milli> patch_time = std::chrono::steady_clock::now() - start;
+
+	float max_difference = 0.0;
+	for (int i = 0; i < n; i += 997)
+		for (int k = 0; k < 3; k++)
+			for (int e = 0; e < 16; e++)
+				max_difference = std::max(max_difference, std::abs(separate[3 * i + k][e / 4][e % 4] - batch.matrix(i, k)[e / 4][e % 4]));
+
+	std::cout << "Patch matrices for " << n << " patches\n";
+	std::cout << "  one BezierPatch at a time: " << patch_time.count() << " ms\n";
+	std::cout << "  batched:                   " << batch_time.count() << " ms, again into the same storage " << rebuild_time.count() << " ms, " << batch.bytes() / (1024 * 1024)
+		<< " MB in one allocation, max difference " << max_difference << "\n";
+}
+
+// Tessellate n synthetic patches into grids on 1, 2, 4... threads, up to as
+// many as the worker pool has
+void benchmark_threads(int n) {
+	std::vector<point3> points;
+	std::vector<PatchIndex> indices;
+	make_synthetic_model(n, points, indices);
+	PatchMatrices matrices;
+	build_patch_matrices(&points[0], &indices[0], n, matrices);
+	std::vector<BezierPatch> model;
+	std::vector<int> all(n);
+	model.reserve(n);
+	for (int i = 0; i < n; i++) {
+		point3 cps[16];
+		for (int j = 0; j < 16; j++)
+			cps[j] = points[indices[i].cp_idxs[j] - 1];
+		model.push_back(BezierPatch(cps, matrices.matrix(i, 0), matrices.matrix(i, 1), matrices.matrix(i, 2)));
+		all[i] = i;
+	}
+
+	int hardware_threads = std::max(int(std::thread::hardware_concurrency()), 1);
+	int max_threads = workers.size();
+	std::cout << "Grid tessellation of " << n << " patches, " << num_increments << " x " << num_increments
+		<< " each (" << hardware_threads << " hardware threads)\n";
+	TriangleMesh mesh;
+	double one_thread = 0.0;
+	for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+		WorkerPool pool;
+		pool.start(threads);
+		build_grid_mesh(pool, matrices, model, all, num_increments, mesh); // first touch of the output
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const int runs = 5;
+		for (int i = 0; i < runs; i++)
+			build_grid_mesh(pool, matrices, model, all, num_increments, mesh);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		double ms = elapsed.count() / runs;
+		if (threads == 1)
+			one_thread = ms;
+		std::cout << "  " << threads << " thread" << (threads == 1 ? ": " : "s: ") << ms << " ms, "
+			<< one_thread / ms << "x\n";
+		if (threads == max_threads)
+			break;
+	}
+}
+
+// Ray-cast the default view one ray at a time and in packets, on 1, 2, 4...
+// threads up to as many as the worker pool has
+void benchmark_rays(int width, int height) {
+	model_view = model_view_matrix();
+	int max_threads = workers.size();
+	std::cout << "Ray casting a " << width << " x " << height << " view, " << ray_tile << " x " << ray_tile << " ray packets\n";
+	std::vector<unsigned char> single_image, packet_image;
+	for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+		WorkerPool pool;
+		pool.start(threads);
+		double rays_per_second[2];
+		for (int packets = 0; packets < 2; packets++) {
+			std::vector<unsigned char> &image = packets ? packet_image : single_image;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			ray_cast_view(pool, width, height, packets != 0, image);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			rays_per_second[packets] = width * height / elapsed.count();
+		}
+		std::cout << "  " << threads << " thread" << (threads == 1 ? ": " : "s: ") << rays_per_second[0] / 1e6
+			<< " Mrays/s one at a time, " << rays_per_second[1] / 1e6 << " Mrays/s in packets\n";
+		if (threads == max_threads)
+			break;
+	}
+	int differing = 0;
+	for (size_t i = 0; i < single_image.size(); i += 3)
+		differing += memcmp(&single_image[i], &packet_image[i], 3) != 0;
+	std::cout << "  packets and single rays differ in " << differing << " pixels\n";
+}
+
+// Evaluate every patch of the model over n x n grids, point by point with
+// patch_point_normal, by forward differencing with evaluate_grid and as
+// batched matrix products with evaluate_patch_grids
+void benchmark_grid_evaluation() {
+	int num_patches = patch_indices.size();
+	std::cout << "Grid evaluation of the model's " << num_patches << " patches\n";
+	PatchMatrices matrices;
+	build_patch_matrices(&loaded_points[0], &patch_indices[0], num_patches, matrices);
+	std::vector<BezierPatch> model;
+	std::vector<int> all(num_patches);
+	for (int p = 0; p < num_patches; p++) {
+		model.push_back(patches.patch(p));
+		all[p] = p;
+	}
+
+	for (int n = 16; n <= 256; n *= 2) {
+		size_t grid = size_t(n) * n;
+		std::vector<point3> positions(grid), normals(grid), fd_positions(grid * num_patches), fd_normals(grid * num_patches);
+		std::vector<point3> batch_positions(grid * num_patches), batch_normals(grid * num_patches);
+		const int runs = std::max(4096 / n, 1);
+		double direct_ms = 0.0, fd_ms = 0.0, batch_ms = 0.0;
+		float fd_error[2] = { 0.0, 0.0 }, batch_error[2] = { 0.0, 0.0 };
+		for (int p = 0; p < num_patches; p++) {
+			const BezierPatch &patch = model[p];
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int run = 0; run < runs; run++)
+				for (int i = 0; i < n; i++)
+					for (int j = 0; j < n; j++)
+						patch.patch_point_normal(float(i) / (n - 1), float(j) / (n - 1), positions[i * n + j], normals[i * n + j]);
+			std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+			for (int run = 0; run < runs; run++)
+				patch.evaluate_grid(n, &fd_positions[p * grid], &fd_normals[p * grid]);
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+			direct_ms += std::chrono::duration<double, std::milli>(middle - start).count() / runs;
+			fd_ms += std::chrono::duration<double, std::milli>(end - middle).count() / runs;
+			for (int i = 0; i < grid; i++) {
+				fd_error[0] = std::max(fd_error[0], distance(positions[i], fd_positions[p * grid + i]));
+				fd_error[1] = std::max(fd_error[1], distance(normals[i], fd_normals[p * grid + i]));
+			}
+		}
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int run = 0; run < runs; run++)
+			evaluate_patch_grids(matrices, model, &all[0], num_patches, n, &batch_positions[0], &batch_normals[0]);
+		batch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+		for (int p = 0; p < num_patches; p++) {
+			for (int i = 0; i < n; i++) {
+				for (int j = 0; j < n; j++) {
+					point3 position, normal;
+					model[p].patch_point_normal(float(i) / (n - 1), float(j) / (n - 1), position, normal);
+					batch_error[0] = std::max(batch_error[0], distance(position, batch_positions[p * grid + i * n + j]));
+					batch_error[1] = std::max(batch_error[1], distance(normal, batch_normals[p * grid + i * n + j]));
+				}
+			}
+		}
+		std::cout << "  " << n << " x " << n << ": " << direct_ms << " ms point by point, " << fd_ms << " ms forward differenced ("
+			<< direct_ms / fd_ms << "x), " << batch_ms << " ms as batched products (" << direct_ms / batch_ms << "x); largest differences "
+			<< fd_error[0] << " / " << batch_error[0] << " in position and " << fd_error[1] << " / " << batch_error[1] << " in normal\n";
+	}
+}
+
+// Whether every cell of a segments x segments grid over a patch is within
+// tolerance of its two triangles
+bool grid_flat(const BezierPatch &patch, int segments, float tolerance) {
+	float step = 1.0f / segments;
+	for (int i = 0; i < segments; i++) {
+		for (int j = 0; j < segments; j++) {
+			point3 cell[16];
+			sub_patch(patch.cps, i * step, (i + 1) * step, j * step, (j + 1) * step, cell);
+			if (patch_flatness(cell).error > tolerance)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Subdivide the whole model at several tolerances, against the uniform grid
+// that the same flatness test would need for each
+void benchmark_subdivision() {
+	int num_patches = patch_indices.size();
+	std::vector<BezierPatch> model;
+	std::vector<int> all(num_patches);
+	for (int p = 0; p < num_patches; p++) {
+		model.push_back(patches.patch(p));
+		all[p] = p;
+	}
+	std::cout << "Subdivision of the model's " << num_patches << " patches\n";
+	TriangleMesh mesh;
+	for (float tolerance = 0.1f; tolerance > 0.001f; tolerance /= 4.0f) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		build_subdivided_mesh(model, patch_indices, all, tolerance, mesh);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		int segments = 1;
+		for (int p = 0; p < num_patches; p++)
+			while (segments < 256 && !grid_flat(model[p], segments, tolerance))
+				segments++;
+		std::cout << "  tolerance " << tolerance << ": " << mesh.indices.size() / 3 << " triangles in " << elapsed.count()
+			<< " ms; a uniform grid needs " << segments << " x " << segments << " segments per patch, "
+			<< 2 * segments * segments * num_patches << " triangles\n";
+	}
+}
+
+void run_benchmark() {
+	const int frames = 200;
+	reshape(640, 640);
+	model_view = model_view_matrix();
+	glUniformMatrix4fv(ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+
+	std::cout << "Benchmark (" << frames << " frames each)\n";
+	std::cout << "  per-frame tessellation: " << time_draws(&BezierPatchCollection::draw_immediate, frames) << " ms/frame streamed, "
+		<< time_draws(&BezierPatchCollection::draw_immediate_rows, frames) << " ms/frame uploaded row by row\n";
+	std::cout << "  static tessellation:    " << time_draws(&BezierPatchCollection::draw, frames) << " ms/frame\n";
+	std::cout << "  welded triangle mesh:   " << time_draws(&BezierPatchCollection::draw_mesh, frames) << " ms/frame\n";
+	std::cout << "  shaded triangle mesh:   " << time_draws(&BezierPatchCollection::draw_shaded, frames) << " ms/frame\n";
+	std::cout << "  GPU patch evaluation:   " << time_draws(&BezierPatchCollection::draw_gpu, frames) << " ms/frame\n";
+	std::cout << "  adaptive tessellation:  " << time_draws(&BezierPatchCollection::draw_adaptive, frames) << " ms/frame ("
+		<< patches.adaptive_triangles() << " triangles)\n";
+	std::cout << "  parallel tessellation:  " << time_draws(&BezierPatchCollection::draw_parallel, frames) << " ms/frame ("
+		<< workers.size() << " threads)\n";
+	std::cout << "  subdivided:             " << time_draws(&BezierPatchCollection::draw_subdivided, frames) << " ms/frame ("
+		<< patches.subdivided_triangles() << " triangles)\n";
+	if (tessellation_supported)
+		std::cout << "  hardware tessellation:  " << time_draws(&BezierPatchCollection::draw_tess, frames) << " ms/frame\n";
+
+
+	// Close up, where most of the model is out of view
+	float saved_zoom = zoom;
+	zoom = 4.0;
+	model_view = model_view_matrix();
+	glUniformMatrix4fv(ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
+	for (int on = 1; on >= 0; on--) {
+		culling = back_culling = on;
+		double shaded_ms = time_draws(&BezierPatchCollection::draw_shaded, frames);
+		double parallel_ms = time_draws(&BezierPatchCollection::draw_parallel, frames);
+		const CullStats &stats = patches.last_cull();
+		std::cout << "Zoomed in, culling " << (on ? "on: " : "off:") << " shaded " << shaded_ms << " ms/frame, parallel "
+			<< parallel_ms << " ms/frame, " << stats.visible << " patches drawn, " << stats.culled << " outside the view, "
+			<< stats.back_facing << " facing away, " << stats.nodes_visited << " BVH nodes tested\n";
+	}
+	culling = back_culling = true;
+	zoom = saved_zoom;
+
+	// Many copies of the model: instanced, the draw calls stay at one
+	const int stress_frames = 5;
+	std::cout << "Instanced model (" << stress_frames << " frames each)\n";
+	std::vector<glm::mat4> instances;
+	for (int n = 1; n <= 4096; n *= 8) {
+		make_instance_grid(n, patches.bounds(), instances);
+		patches.set_instances(instances);
+		double instanced_ms = time_draws(&BezierPatchCollection::draw_instanced, stress_frames);
+		double one_by_one_ms = time_draws(&BezierPatchCollection::draw_instances_one_by_one, stress_frames);
+		std::cout << "  " << n << " instance" << (n == 1 ? ": " : "s: ") << instanced_ms << " ms/frame in 1 draw call, "
+			<< one_by_one_ms << " ms/frame one by one in " << n << " draw call" << (n == 1 ? "\n" : "s\n");
+	}
+	make_instance_grid(num_instances, patches.bounds(), instances);
+	patches.set_instances(instances);
+
+	// How many patches face away, over views from every direction
+	GLfloat saved_theta[NumAxes];
+	std::copy(Theta, Theta + NumAxes, saved_theta);
+	int views = 0, back_facing = 0;
+	for (int x = 0; x < 360; x += 15) {
+		for (int y = 0; y < 360; y += 15) {
+			Theta[Xaxis] = x;
+			Theta[Yaxis] = y;
+			model_view = model_view_matrix();
+			patches.cull(true);
+			back_facing += patches.last_cull().back_facing;
+			views++;
+		}
+	}
+	std::cout << "Back-patch culling skips " << float(back_facing) / views << " patches per view on average"
+		<< (patches.closed() ? "\n" : " (the model has open edges)\n");
+	std::copy(saved_theta, saved_theta + NumAxes, Theta);
+	model_view = model_view_matrix();
+
+	benchmark_matrices(1000000);
+	benchmark_threads(100000);
+	benchmark_grid_evaluation();
+	benchmark_subdivision();
+	benchmark_rays(640, 640);
+}
+
+//----------------------------------------------------------------------------
+
+// Load the --patches file (teapot by default) and build its patches
+void load_model(std::vector<BezierPatch> &model) {
+	const char *filename = option_value("--patches") ? option_value("--patches") : "teapot";
+	std::chrono::steady_clock::time_point load_start = std::chrono::steady_clock::now();
+	if (!patch_file.load(filename))
+		exit(1);
+	std::chrono::duration<double, std::milli> load_time = std::chrono::steady_clock::now() - load_start;
+	std::cout << "Loaded " << patch_file.num_patches << " patches and " << patch_file.num_points << " points from "
+		<< filename << (patch_file.from_cache ? ".cache" : "") << " in " << load_time.count() << " ms\n";
+	patch_indices.assign(patch_file.indices, patch_file.indices + patch_file.num_patches);
+	loaded_points.assign(patch_file.points, patch_file.points + patch_file.num_points);
+
+	PatchMatrices matrices;
+	build_patch_matrices(patch_file.points, patch_file.indices, patch_file.num_patches, matrices);
+	model.clear();
+	model.reserve(patch_indices.size());
+	for (int i = 0; i < patch_indices.size(); i++) {
+		point3 cps[16];
+		for (int j = 0; j < 16; j++)
+			cps[j] = patch_file.points[patch_indices[i].cp_idxs[j]-1];
+		model.push_back(BezierPatch(cps, matrices.matrix(i, 0), matrices.matrix(i, 1), matrices.matrix(i, 2)));
+	}
+}
+
+// Hand a built model to the globals and the collection
+void finish_loading(PatchModel &model) {
+	patch_indices.swap(model.indices);
+	loaded_points.swap(model.points);
+	std::swap(point_patches, model.point_patches);
+	patches.build(model);
+	std::vector<glm::mat4> instances;
+	make_instance_grid(num_instances, patches.bounds(), instances);
+	patches.set_instances(instances);
+}
+
+// Windows load the model in the background and draw it as it arrives. Runs
+// that need the whole model before their first frame load it up front:
+// --headless (unless --async-load), --raycast and --bench. So do --record
+// and --replay, since keys that act on the model are dropped while it loads
+// and the load takes a different number of frames from run to run.
+ModelLoader loader;
+bool loading = false;
+
+bool load_in_background() {
+	if (option_value("--raycast") || has_option("--bench") || option_value("--record") || option_value("--replay"))
+		return false;
+	return has_option("--async-load") || !has_option("--headless");
+}
+
+// Take whatever batches the loader has finished since the last frame
+void receive_batches() {
+	PatchBatch *batch;
+	while (loading && (batch = loader.next()) != NULL) {
+		if (batch->last) {
+			if (!loader.succeeded())
+				exit(EXIT_FAILURE);
+			std::cout << "Loaded " << batch->total << " patches from " << (option_value("--patches") ? option_value("--patches") : "teapot")
+				<< (loader.cached() ? ".cache" : "") << " in the background, file read in " << loader.file_ms() << " ms\n";
+			PatchModel model;
+			loader.take_model(model);
+			if (batch->total > 0)
+				patches.end_loading();
+			finish_loading(model);
+			loading = false;
+		}
+		else {
+			if (batch->first == 0)
+				patches.begin_loading(batch->total);
+			patches.add_batch(*batch);
+		}
+		delete batch;
+	}
+}
+
+// --export <file> converts the --patches file to a mesh file: binary PLY, or
+// OBJ for a name ending in .obj. The mesh is the welded grid of --grid <n>
+// vertices along each side of a patch (16 by default), or with --tolerance
+// <t> the subdivided mesh.
+void export_model(const char *filename) {
+	std::vector<BezierPatch> model;
+	load_model(model);
+	TriangleMesh mesh;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (option_value("--tolerance")) {
+		std::vector<int> all(model.size());
+		for (int i = 0; i < all.size(); i++)
+			all[i] = i;
+		build_subdivided_mesh(model, patch_indices, all, atof(option_value("--tolerance")), mesh);
+	}
+	else
+		build_welded_mesh(model, patch_indices, option_value("--grid") ? std::max(atoi(option_value("--grid")), 2) : 16, mesh);
+	std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+	size_t bytes = 0;
+	if (!write_mesh(filename, mesh, &bytes))
+		exit(EXIT_FAILURE);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	std::cout << "Wrote " << mesh.positions.size() << " vertices and " << mesh.indices.size() / 3 << " triangles to " << filename
+		<< " (" << bytes << " bytes): tessellated in " << std::chrono::duration<double, std::milli>(middle - start).count()
+		<< " ms, written in " << std::chrono::duration<double, std::milli>(end - middle).count() << " ms\n";
+}
+
+// --chunk <file> converts the --patches file to a chunked file for
+// --chunked, of --chunk-size <n> patches per chunk (256 by default)
+void chunk_model(const char *filename) {
+	const char *source = option_value("--patches") ? option_value("--patches") : "teapot";
+	if (!patch_file.load(source))
+		exit(EXIT_FAILURE);
+	int patches_per_chunk = option_value("--chunk-size") ? std::max(atoi(option_value("--chunk-size")), 1) : 256;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (!write_chunked_model(filename, patch_file, patches_per_chunk))
+		exit(EXIT_FAILURE);
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Wrote " << patch_file.num_patches << " patches from " << source << " to " << filename << " in "
+		<< (patch_file.num_patches + patches_per_chunk - 1) / patches_per_chunk << " chunks of up to " << patches_per_chunk
+		<< " in " << elapsed.count() << " ms\n";
+}
+
+// --software draws frames on the CPU alone, turning as the window would,
+// without ever making a GL context. --frames, --dump, --zoom and --threads
+// work as with --headless; --grid <n> sets the vertices along each side of
+// a patch. --export needs no GL either.
+bool run_without_gl() {
+	if (option_value("--export")) {
+		export_model(option_value("--export"));
+		return true;
+	}
+	if (option_value("--chunk")) {
+		chunk_model(option_value("--chunk"));
+		return true;
+	}
+	if (!has_option("--software"))
+		return false;
+	workers.start(option_value("--threads") ? atoi(option_value("--threads")) : 0);
+	std::vector<BezierPatch> model;
+	load_model(model);
+	if (option_value("--zoom"))
+		zoom = atof(option_value("--zoom"));
+
+	int grid = option_value("--grid") ? std::max(atoi(option_value("--grid")), 2) : 16;
+	TriangleMesh mesh;
+	build_welded_mesh(model, patch_indices, grid, mesh);
+
+	const int width = 640, height = 640;
+	SoftwareRenderer renderer;
+	renderer.resize(width, height);
+	projection = projection_matrix(width, height);
+	int frames = option_value("--frames") ? atoi(option_value("--frames")) : 300;
+	const char *dump_prefix = option_value("--dump");
+
+	double total_ms = 0.0;
+	for (int frame = 0; frame < frames; frame++) {
+		update(); // first, as the headless loop does
+		model_view = model_view_matrix();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		renderer.render(workers, mesh, model_view, projection);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		total_ms += elapsed.count();
+		if (dump_prefix) {
+			char filename[1024];
+			snprintf(filename, sizeof(filename), "%s%04d.ppm", dump_prefix, frame);
+			if (!write_ppm(filename, width, height, renderer.pixels()))
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (frames > 0)
+		std::cout << "Software rendered " << frames << " frames of " << mesh.indices.size() / 3 << " triangles at "
+			<< width << " x " << height << ": " << total_ms / frames << " ms/frame, " << frames * 1000.0 / total_ms
+			<< " frames/s on " << workers.size() << " threads\n";
+	return true;
+}
+
 // OpenGL initialization
 void
 init()
 {
    // Create a vertex array object
-   GLuint vao = 0;
-   glGenVertexArrays( 1, &vao );
-   glBindVertexArray( vao );
+   glGenVertexArrays( 1, &dynamic_vao );
+   glBindVertexArray( dynamic_vao );
 
-   GLuint buffer;
    // Create and initialize a buffer object
-   glGenBuffers( 1, &buffer );
-   glBindBuffer( GL_ARRAY_BUFFER, buffer );
+   glGenBuffers( 1, &dynamic_buffer );
+   glBindBuffer( GL_ARRAY_BUFFER, dynamic_buffer );
 
    // Load shaders and use the resulting shader program
-   GLuint program = InitShader( "vshader6.glsl", "fshader5.glsl" );
+   shaded.program = InitShader( "vshader_shaded.glsl", "fshader_shaded.glsl" );
+   shaded.ModelView = glGetUniformLocation( shaded.program, "ModelView" );
+   shaded.Projection = glGetUniformLocation( shaded.program, "Projection" );
+   shaded.vPosition = glGetAttribLocation( shaded.program, "vPosition" );
+   shaded.vNormal = glGetAttribLocation( shaded.program, "vNormal" );
+
+   gpu_eval.program = InitShader( "vshader_patch.glsl", "fshader_shaded.glsl" );
+   gpu_eval.ModelView = glGetUniformLocation( gpu_eval.program, "ModelView" );
+   gpu_eval.Projection = glGetUniformLocation( gpu_eval.program, "Projection" );
+   gpu_eval.Patches = glGetUniformLocation( gpu_eval.program, "Patches" );
+   gpu_eval.Visible = glGetUniformLocation( gpu_eval.program, "Visible" );
+   gpu_eval.vUV = glGetAttribLocation( gpu_eval.program, "vUV" );
+   glUniform1i( gpu_eval.Patches, 0 );
+   glUniform1i( gpu_eval.Visible, 1 );
+
+   instanced.program = InitShader( "vshader_instanced.glsl", "fshader_shaded.glsl" );
+   instanced.ModelView = glGetUniformLocation( instanced.program, "ModelView" );
+   instanced.Projection = glGetUniformLocation( instanced.program, "Projection" );
+   instanced.vPosition = glGetAttribLocation( instanced.program, "vPosition" );
+   instanced.vNormal = glGetAttribLocation( instanced.program, "vNormal" );
+   instanced.vInstance = glGetAttribLocation( instanced.program, "vInstance" );
+
+   GLint major_version = 0;
+   glGetIntegerv( GL_MAJOR_VERSION, &major_version );
+   tessellation_supported = major_version >= 4;
+   if ( tessellation_supported ) {
+      tess.program = InitShader( "vshader_tess.glsl", "tcshader_patch.glsl",
+                                 "teshader_patch.glsl", "fshader_shaded.glsl" );
+      tess.ModelView = glGetUniformLocation( tess.program, "ModelView" );
+      tess.Projection = glGetUniformLocation( tess.program, "Projection" );
+      tess.Viewport = glGetUniformLocation( tess.program, "Viewport" );
+      tess.PixelsPerSegment = glGetUniformLocation( tess.program, "PixelsPerSegment" );
+      tess.vPosition = glGetAttribLocation( tess.program, "vPosition" );
+      glUniform1f( tess.PixelsPerSegment, pixels_per_segment );
+   }
+
+   program = InitShader( "vshader6.glsl", "fshader5.glsl" );
    glUseProgram( program );
 
    // set up vertex arrays
-   GLuint vPosition = glGetAttribLocation( program, "vPosition" );
+   vPosition = glGetAttribLocation( program, "vPosition" );
    glEnableVertexAttribArray( vPosition );
    glVertexAttribPointer( vPosition, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
 
@@ -167,58 +1412,184 @@ init()
    glClearColor( 1.0, 1.0, 1.0, 1.0 );
    glPointSize(10.0f);
 
-   std::string filename_str = "teapot";
-   char *filename = &filename_str[0u];
-   int num_patches = 0;
-   int num_points = 0;
-   load_patch(filename, &num_patches, &num_points);
-
-   std::vector<point3> all_points;
-   for (int i = 0; i < patch_indices.size(); i++) {
-	   std::vector<int> cp_idxs = patch_indices[i].cp_idxs;
-	   for (int j = 0; j < 16; j++)
-		   all_points.push_back(loaded_points[cp_idxs[j]-1]);
+   workers.start(option_value("--threads") ? atoi(option_value("--threads")) : 0);
+   if (option_value("--instances"))
+	   num_instances = std::max(atoi(option_value("--instances")), 0);
+   if (option_value("--chunked")) {
+	   double budget_mb = option_value("--budget") ? atof(option_value("--budget")) : 256.0;
+	   if (!out_of_core_model.open(option_value("--chunked"), size_t(std::max(budget_mb, 0.0) * 1048576.0)))
+		   exit(EXIT_FAILURE);
+	   out_of_core = true;
+   }
+   else if (load_in_background()) {
+	   loading = true;
+	   loader.start(option_value("--patches") ? option_value("--patches") : "teapot", workers);
+   }
+   else {
+	   PatchModel model;
+	   load_model(model.patches);
+	   model.indices = patch_indices;
+	   model.points = loaded_points;
+	   model.build(workers);
+	   finish_loading(model);
    }
 
-   for (int i = 0; i < all_points.size() / 16; i++)
-	   patches.add_patch(BezierPatch(&all_points[16*i]));
+   if (option_value("--zoom"))
+	   zoom = atof(option_value("--zoom"));
+   if (option_value("--tolerance"))
+	   chord_tolerance = atof(option_value("--tolerance"));
+   if (has_option("--no-cull"))
+	   culling = false;
+   if (has_option("--no-back-cull"))
+	   back_culling = false;
+   for (int i = 0; i < NumRenderModes; i++) {
+	   if (option_value("--mode") && strcmp(option_value("--mode"), render_mode_names[i]) == 0)
+		   render_mode = i;
+   }
+   if (render_mode == TessMode && !tessellation_supported) {
+	   std::cout << "Tessellation shaders need OpenGL 4.0, drawing shaded instead\n";
+	   render_mode = ShadedMode;
+   }
+   // Nothing else works without the whole model
+   if (out_of_core)
+	   return;
+   if (option_value("--raycast")) {
+	   reshape(window_width, window_height);
+	   model_view = model_view_matrix();
+	   std::vector<unsigned char> rgb;
+	   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	   ray_cast_view(workers, window_width, window_height, true, rgb);
+	   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	   if (!write_ppm(option_value("--raycast"), window_width, window_height, &rgb[0]))
+		   exit(EXIT_FAILURE);
+	   std::cout << "Ray-cast " << window_width << " x " << window_height << " view to " << option_value("--raycast")
+		   << " in " << elapsed.count() * 1000.0 << " ms, " << window_width * window_height / elapsed.count() / 1e6
+		   << " Mrays/s on " << workers.size() << " threads\n";
+	   exit(EXIT_SUCCESS);
+   }
+   if (has_option("--bench")) {
+	   run_benchmark();
+	   exit(EXIT_SUCCESS);
+   }
+}
+// Why the whole model isn't there to pick, edit, cull or change the mode
+// of, or NULL when it is
+const char *whole_model_missing() {
+	if (out_of_core)
+		return "the model is drawn out of core";
+	if (loading)
+		return "the model is still loading";
+	return NULL;
 }
+
+// The keys that pick, edit, cull or change the mode
+bool needs_whole_model(unsigned char key) {
+	return key != 0 && strchr("pPxXyYzZcCbBmM", key) != NULL;
+}
+
 //----------------------------------------------------------------------------
 void
 display(void)
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-
-	//  Generate the model-view matrix
-	const glm::vec3 viewer_pos(0.0, 0.0, 2.0);
-	glm::mat4 view_trans, trans, rot, scale, model_view;
-	rot = glm::rotate(rot, glm::radians(Theta[Xaxis]), glm::vec3(1, 0, 0));
-	rot = glm::rotate(rot, glm::radians(Theta[Yaxis]), glm::vec3(0, 1, 0));
-	rot = glm::rotate(rot, glm::radians(Theta[Zaxis]), glm::vec3(0, 0, 1));
-	view_trans = glm::translate(view_trans, -viewer_pos);
-	scale = glm::scale(scale, glm::vec3(0.18, 0.18, 0.18));
-	trans = glm::translate(trans, glm::vec3(0.0, 0.0, -0.7));
-	model_view = view_trans * scale * rot * trans;
+	model_view = model_view_matrix();
 	glUniformMatrix4fv(ModelView, 1, GL_FALSE, glm::value_ptr(model_view));
-
-	patches.draw();
+	if (out_of_core) {
+		out_of_core_model.draw();
+		swap_buffers();
+		return;
+	}
+	if (loading)
+		receive_batches();
+	if (loading) {
+		patches.draw_loading();
+		swap_buffers();
+		return;
+	}
+	switch (render_mode) {
+	case LinesMode:      patches.draw();            break;
+	case ImmediateMode:  patches.draw_immediate();  break;
+	case MeshMode:       patches.draw_mesh();       break;
+	case ShadedMode:     patches.draw_shaded();     break;
+	case GpuMode:        patches.draw_gpu();        break;
+	case TessMode:       patches.draw_tess();       break;
+	case AdaptiveMode:   patches.draw_adaptive();   break;
+	case ParallelMode:   patches.draw_parallel();   break;
+	case InstancedMode:  patches.draw_instanced();  break;
+	case SubdividedMode: patches.draw_subdivided(); break;
+	}
 	if(show_control_points)
 		patches.draw_cps();
 
-   glutSwapBuffers();
+   swap_buffers();
 }
 
 //----------------------------------------------------------------------------
 void
 keyboard( unsigned char key, int x, int y )
 {
+     if ( needs_whole_model( key ) && whole_model_missing() ) {
+        std::cout << "'" << key << "' does nothing while " << whole_model_missing() << "\n";
+        return;
+     }
      switch( key ) {
        case 033: // Escape Key
        case 'q': case 'Q':
           exit( EXIT_SUCCESS );
 	   case ' ':
 		   show_control_points = !show_control_points;
+		   break;
+	   case '+': case '=':
+	   case '-': case '_':
+		   zoom *= (key == '+' || key == '=') ? 1.25 : 0.8;
+		   if (out_of_core) {
+			   const PatchChunkCache &cache = out_of_core_model.chunk_cache();
+			   std::cout << "Zoom " << zoom << ", last frame drew " << cache.last_frame().drawn << " of " << cache.last_frame().in_view
+				   << " chunks in view, loading " << cache.last_frame().loaded << " and evicting " << cache.last_frame().evicted
+				   << "; " << cache.resident() << " chunks, " << cache.bytes_used() / 1048576.0 << " MB cached, "
+				   << cache.loads() << " loads and " << cache.evictions() << " evictions so far\n";
+			   break;
+		   }
+		   if (whole_model_missing()) {
+			   std::cout << "Zoom " << zoom << "\n";
+			   break;
+		   }
+		   std::cout << "Zoom " << zoom << ", " << patches.last_cull().visible << " patches in view";
+		   if (render_mode == AdaptiveMode)
+			   std::cout << ", last adaptive frame had " << patches.adaptive_triangles() << " triangles";
+		   if (render_mode == SubdividedMode)
+			   std::cout << ", tolerance " << chord_tolerance / zoom << ", last subdivided frame had " << patches.subdivided_triangles() << " triangles";
+		   std::cout << "\n";
+		   break;
+	   case 'c': case 'C':
+		   culling = !culling;
+		   std::cout << "Frustum culling " << (culling ? "on" : "off") << ", last frame drew "
+			   << patches.last_cull().visible << " patches and culled " << patches.last_cull().culled
+			   << " after testing " << patches.last_cull().nodes_visited << " BVH nodes\n";
+		   break;
+	   case 'b': case 'B':
+		   back_culling = !back_culling;
+		   std::cout << "Back-patch culling " << (back_culling ? "on" : "off");
+		   if ( patches.closed() )
+			   std::cout << ", last frame skipped " << patches.last_cull().back_facing << " patches facing away\n";
+		   else
+			   std::cout << ", but the model has open edges, so no patch is skipped\n";
+		   break;
+	   case 'p': case 'P':
+		   pick(x, y);
+		   break;
+	   case 'x': move_selected_point(point3(edit_step, 0.0, 0.0));  break;
+	   case 'X': move_selected_point(point3(-edit_step, 0.0, 0.0)); break;
+	   case 'y': move_selected_point(point3(0.0, edit_step, 0.0));  break;
+	   case 'Y': move_selected_point(point3(0.0, -edit_step, 0.0)); break;
+	   case 'z': move_selected_point(point3(0.0, 0.0, edit_step));  break;
+	   case 'Z': move_selected_point(point3(0.0, 0.0, -edit_step)); break;
+	   case 'm': case 'M':
+		   render_mode = (render_mode + 1) % NumRenderModes;
+		   if (render_mode == TessMode && !tessellation_supported)
+			   render_mode = (render_mode + 1) % NumRenderModes;
+		   std::cout << "Drawing " << render_mode_names[render_mode] << "\n";
+		   break;
     }
 }
 
@@ -236,6 +1607,8 @@ mouse(int button, int state, int x, int y)
 	}
 }
 
+void motion(int x, int y) {}
+
 //----------------------------------------------------------------------------
 
 void
@@ -255,9 +1628,22 @@ void
 reshape( int width, int height )
 {
 	glViewport(0, 0, width, height);
+	window_width = width;
+	window_height = height;
 
-	GLfloat aspect = GLfloat(width) / height;
-	glm::mat4  projection = glm::perspective(glm::radians(45.0f), aspect, 0.5f, 3.0f);
+	projection = projection_matrix(width, height);
 
 	glUniformMatrix4fv(Projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUseProgram(shaded.program);
+	glUniformMatrix4fv(shaded.Projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUseProgram(gpu_eval.program);
+	glUniformMatrix4fv(gpu_eval.Projection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUseProgram(instanced.program);
+	glUniformMatrix4fv(instanced.Projection, 1, GL_FALSE, glm::value_ptr(projection));
+	if (tessellation_supported) {
+		glUseProgram(tess.program);
+		glUniformMatrix4fv(tess.Projection, 1, GL_FALSE, glm::value_ptr(projection));
+		glUniform2f(tess.Viewport, width, height);
+	}
+	glUseProgram(program);
 }
@@ -0,0 +1,218 @@
+#ifndef BEZIER_PATCH_H
+#define BEZIER_PATCH_H
+
+#include "common.h"
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+typedef glm::vec4  color4;
+typedef glm::vec4  point4;
+typedef glm::vec3  point3;
+typedef glm::vec2  point2;
+
+const int num_increments = 8;
+
+// Bezier basis matrix, defined in Q2_teapot.cpp
+extern glm::mat4 M;
+
+
+// The 1-based indices of a patch's 16 control points, as in the patch file.
+// Plain data so that whole arrays of them can be read and written at once.
+class PatchIndex {
+public:
+	int cp_idxs[16];
+};
+
+
+class BezierPatch {
+public:
+	glm::mat4 MGM_x, MGM_y, MGM_z;
+	point3 cps[16]; // control points, 4 rows along u of 4 along v
+	point4 line_vertices[num_increments * 2];
+	BezierPatch(const point3 *cps_) {
+		for (int i = 0; i < 16; i++)
+			cps[i] = cps_[i];
+		float slice[16];
+		MGM_x = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 0, slice));
+		MGM_y = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 1, slice));
+		MGM_z = BezierPatch::construct_MGM(BezierPatch::get_slice(cps_, 2, slice));
+	}
+	// With matrices already built, e.g. by build_patch_matrices
+	BezierPatch(const point3 *cps_, const glm::mat4 &MGM_x_, const glm::mat4 &MGM_y_, const glm::mat4 &MGM_z_)
+		: MGM_x(MGM_x_), MGM_y(MGM_y_), MGM_z(MGM_z_) {
+		for (int i = 0; i < 16; i++)
+			cps[i] = cps_[i];
+	}
+	static glm::mat4 construct_MGM(const float slice[16]) {
+		glm::mat4 G = transpose(glm::make_mat4(slice));
+		return M * G * transpose(M);
+	}
+	// Coordinate j of all 16 control points, into slice
+	static float *get_slice(const point3 *arr, int j, float slice[16]) {
+		for (int i = 0; i < 16; i++)
+			slice[i] = arr[i][j];
+		return slice;
+	}
+	point4 patch_point(glm::mat4 MGM_x, glm::mat4 MGM_y, glm::mat4 MGM_z, float u, float v) const {
+		point4 U = point4(u*u*u, u*u, u, 1.0);
+		point4 V = point4(v*v*v, v*v, v, 1.0);
+		return point4(dot(U, MGM_x * V), dot(U, MGM_y * V), dot(U, MGM_z * V), 1.0);
+	}
+	// Position and tangents at (u,v) in one pass. The tangents reuse the
+	// products of the position: Su swaps U for dU in U.(MGM V), and Sv swaps V
+	// for dV in (U MGM).V
+	void patch_point_tangents(float u, float v, point3 &position, point3 &Su, point3 &Sv) const {
+		point4 U = point4(u*u*u, u*u, u, 1.0);
+		point4 V = point4(v*v*v, v*v, v, 1.0);
+		point4 dU = point4(3.0*u*u, 2.0*u, 1.0, 0.0);
+		point4 dV = point4(3.0*v*v, 2.0*v, 1.0, 0.0);
+
+		point4 MV_x = MGM_x * V, MV_y = MGM_y * V, MV_z = MGM_z * V;
+		point4 UM_x = U * MGM_x, UM_y = U * MGM_y, UM_z = U * MGM_z;
+
+		position = point3(dot(U, MV_x), dot(U, MV_y), dot(U, MV_z));
+		Su = point3(dot(dU, MV_x), dot(dU, MV_y), dot(dU, MV_z));
+		Sv = point3(dot(UM_x, dV), dot(UM_y, dV), dot(UM_z, dV));
+	}
+	// Position and unit normal at (u,v)
+	void patch_point_normal(float u, float v, point3 &position, point3 &normal, bool nudge = true) const {
+		point3 Su, Sv;
+		patch_point_tangents(u, v, position, Su, Sv);
+		normal = cross(Su, Sv);
+
+		if (dot(normal, normal) <= 1e-12f * dot(Su, Su) * dot(Sv, Sv)) {
+			// One tangent vanishes at a pole such as the lid tip. Just inside the
+			// patch Sv grows like h * Suv (or Su does), so the limit normal is
+			// Su x Suv (or Suv x Sv), signed by which way the interior lies.
+			point4 dU = point4(3.0*u*u, 2.0*u, 1.0, 0.0);
+			point4 dV = point4(3.0*v*v, 2.0*v, 1.0, 0.0);
+			point3 Suv = point3(dot(dU, MGM_x * dV), dot(dU, MGM_y * dV), dot(dU, MGM_z * dV));
+			float inward_u = (u < 0.5) ? 1.0 : -1.0;
+			float inward_v = (v < 0.5) ? 1.0 : -1.0;
+			normal = inward_u * cross(Su, Suv) + inward_v * cross(Suv, Sv);
+
+			if (dot(normal, normal) == 0.0) {
+				// Both tangents vanish, so step a little towards the middle
+				point3 unused;
+				if (nudge)
+					patch_point_normal(u + (0.5f - u) * 1e-3f, v + (0.5f - v) * 1e-3f, unused, normal, false);
+				else
+					normal = point3(0.0, 0.0, 1.0);
+				return;
+			}
+		}
+		normal = normalize(normal);
+	}
+	// Positions and unit normals over an n x n grid of (u,v), u = i / (n - 1)
+	// and v = j / (n - 1) at [i * n + j], by forward differencing. The
+	// position and both tangents are each a bicubic U.(B V), so each steps
+	// along a row with three vector adds per vertex instead of being
+	// evaluated, and a step down to the next row updates the tables the rows
+	// start from. Where the normal degenerates at a pole it falls back to
+	// patch_point_normal.
+	void evaluate_grid(int n, point3 *positions, point3 *normals) const {
+		// The coefficients of p, Su and Sv: B[r][c] multiplies U[r] V[c], and
+		// differentiating moves a column (Sv) or row (Su) down a power
+		point3 B[4][4], Bu[4][4], Bv[4][4];
+		for (int r = 0; r < 4; r++)
+			for (int c = 0; c < 4; c++)
+				B[r][c] = point3(MGM_x[c][r], MGM_y[c][r], MGM_z[c][r]);
+		for (int k = 0; k < 4; k++) {
+			Bu[0][k] = Bv[k][0] = point3(0.0);
+			for (int power = 1; power < 4; power++) {
+				Bu[power][k] = float(4 - power) * B[power - 1][k];
+				Bv[k][power] = float(4 - power) * B[k][power - 1];
+			}
+		}
+
+		// H maps a cubic's coefficients to its value and first three forward
+		// differences at 0 for step h, so H B H^T holds every mixed difference
+		// of the bicubic at (0,0)
+		float h = 1.0f / (n - 1);
+		float H[4][4] = {
+			{ 0.0f, 0.0f, 0.0f, 1.0f },
+			{ h * h * h, h * h, h, 0.0f },
+			{ 6.0f * h * h * h, 2.0f * h * h, 0.0f, 0.0f },
+			{ 6.0f * h * h * h, 0.0f, 0.0f, 0.0f }
+		};
+		point3 P[4][4], Pu[4][4], Pv[4][4];
+		const point3 (*coefficients[3])[4] = { B, Bu, Bv };
+		point3 (*tables[3])[4] = { P, Pu, Pv };
+		for (int t = 0; t < 3; t++) {
+			point3 HB[4][4];
+			for (int i = 0; i < 4; i++) {
+				for (int c = 0; c < 4; c++) {
+					HB[i][c] = point3(0.0);
+					for (int r = 0; r < 4; r++)
+						HB[i][c] += H[i][r] * coefficients[t][r][c];
+				}
+			}
+			for (int i = 0; i < 4; i++) {
+				for (int j = 0; j < 4; j++) {
+					tables[t][i][j] = point3(0.0);
+					for (int c = 0; c < 4; c++)
+						tables[t][i][j] += HB[i][c] * H[j][c];
+				}
+			}
+		}
+
+		for (int i = 0; i < n; i++) {
+			point3 p[4] = { P[0][0], P[0][1], P[0][2], P[0][3] };
+			point3 su[4] = { Pu[0][0], Pu[0][1], Pu[0][2], Pu[0][3] };
+			point3 sv[4] = { Pv[0][0], Pv[0][1], Pv[0][2], Pv[0][3] };
+			for (int j = 0; j < n; j++) {
+				point3 normal = cross(su[0], sv[0]);
+				if (dot(normal, normal) > 1e-12f * dot(su[0], su[0]) * dot(sv[0], sv[0])) {
+					positions[i * n + j] = p[0];
+					normals[i * n + j] = normalize(normal);
+				}
+				else
+					patch_point_normal(i * h, j * h, positions[i * n + j], normals[i * n + j]);
+				for (int k = 0; k < 3; k++) {
+					p[k] += p[k + 1];
+					su[k] += su[k + 1];
+					sv[k] += sv[k + 1];
+				}
+			}
+			for (int k = 0; k < 3; k++) {
+				for (int c = 0; c < 4; c++) {
+					P[k][c] += P[k + 1][c];
+					Pu[k][c] += Pu[k + 1][c];
+					Pv[k][c] += Pv[k + 1][c];
+				}
+			}
+		}
+	}
+	void draw() {
+		for (int i = 0; i < num_increments; i++) {
+			for (int j = 0; j < num_increments; j++) {
+				float u = 1.0 / (num_increments - 1) * i;
+				float v = 1.0 / (num_increments - 1) * j;
+
+				line_vertices[j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, u, v);
+				line_vertices[num_increments+j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, v, u);
+			}
+			glBufferData(GL_ARRAY_BUFFER, sizeof(line_vertices), line_vertices, GL_STATIC_DRAW);
+			glDrawArrays(GL_LINE_STRIP, 0, num_increments);
+			glDrawArrays(GL_LINE_STRIP, num_increments, num_increments);
+		}
+	}
+	// Same lines as draw(), but every row at once: num_increments pairs of
+	// u and v line strips, each num_increments vertices long
+	static const int num_line_vertices = 2 * num_increments * num_increments;
+	void tessellate(point4 *out) {
+		for (int i = 0; i < num_increments; i++) {
+			for (int j = 0; j < num_increments; j++) {
+				float u = 1.0 / (num_increments - 1) * i;
+				float v = 1.0 / (num_increments - 1) * j;
+
+				out[2 * num_increments * i + j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, u, v);
+				out[2 * num_increments * i + num_increments + j] = BezierPatch::patch_point(MGM_x, MGM_y, MGM_z, v, u);
+			}
+		}
+	}
+};
+
+#endif // BEZIER_PATCH_H
@@ -0,0 +1,19 @@
+#version 150
+
+in vec3 fNormal;
+in vec3 fPosition;
+out vec4 color;
+
+void main() 
+{ 
+   // Light from just above the viewer; light both sides of every patch
+   vec3 N = normalize(fNormal);
+   if (!gl_FrontFacing) N = -N;
+   vec3 L = normalize(vec3(0.5, 1.0, 1.0));
+   vec3 E = normalize(-fPosition);
+   vec3 H = normalize(L + E);
+
+   float diffuse = max(dot(L, N), 0.0);
+   float specular = pow(max(dot(N, H), 0.0), 40.0);
+   color = vec4(vec3(0.15) + vec3(0.7, 0.6, 0.5) * diffuse + vec3(0.3) * specular, 1.0);
+}
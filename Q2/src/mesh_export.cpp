@@ -0,0 +1,124 @@
+#include "mesh_export.h"
+#include <cstdarg>
+#include <cstring>
+#include <iostream>
+
+bool FileWriter::open(const char *filename) {
+	close();
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		std::cerr << "Failed to write " << filename << std::endl;
+		return false;
+	}
+	// The buffer here does the buffering
+	setvbuf(fp, NULL, _IONBF, 0);
+	buffer.resize(buffer_size);
+	used = total = 0;
+	failed = false;
+	return true;
+}
+
+void FileWriter::flush() {
+	if (used > 0 && fp != NULL && fwrite(&buffer[0], 1, used, fp) != used)
+		failed = true;
+	used = 0;
+}
+
+void FileWriter::write(const void *data, size_t bytes) {
+	total += bytes;
+	if (used + bytes > buffer.size())
+		flush();
+	if (bytes > buffer.size()) {
+		if (fp != NULL && fwrite(data, 1, bytes, fp) != bytes)
+			failed = true;
+		return;
+	}
+	memcpy(&buffer[used], data, bytes);
+	used += bytes;
+}
+
+void FileWriter::print(const char *format, ...) {
+	const size_t most = 256;
+	if (used + most > buffer.size())
+		flush();
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(&buffer[used], most, format, args);
+	va_end(args);
+	if (length < 0 || length >= int(most)) {
+		failed = true;
+		return;
+	}
+	used += length;
+	total += length;
+}
+
+bool FileWriter::close() {
+	if (fp == NULL)
+		return false;
+	flush();
+	bool ok = (fclose(fp) == 0) && !failed;
+	fp = NULL;
+	return ok;
+}
+
+static bool little_endian() {
+	const unsigned int one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
+bool write_ply(const char *filename, const TriangleMesh &mesh, size_t *bytes) {
+	FileWriter out;
+	if (!out.open(filename))
+		return false;
+	size_t num_triangles = mesh.indices.size() / 3;
+	// Binary PLY takes either byte order, so the data goes out as it is in memory
+	out.print("ply\nformat %s 1.0\n", little_endian() ? "binary_little_endian" : "binary_big_endian");
+	out.print("element vertex %u\n", unsigned(mesh.positions.size()));
+	out.print("property float x\nproperty float y\nproperty float z\n");
+	out.print("property float nx\nproperty float ny\nproperty float nz\n");
+	out.print("element face %u\nproperty list uchar uint vertex_indices\nend_header\n", unsigned(num_triangles));
+
+	for (size_t i = 0; i < mesh.positions.size(); i++) {
+		out.put(mesh.positions[i]);
+		out.put(mesh.normals[i]);
+	}
+	const unsigned char corners = 3;
+	for (size_t t = 0; t < num_triangles; t++) {
+		out.put(corners);
+		out.write(&mesh.indices[3 * t], 3 * sizeof(GLuint));
+	}
+	if (bytes != NULL)
+		*bytes = out.bytes();
+	return out.close();
+}
+
+bool write_obj(const char *filename, const TriangleMesh &mesh, size_t *bytes) {
+	FileWriter out;
+	if (!out.open(filename))
+		return false;
+	out.print("# %u vertices, %u triangles\n", unsigned(mesh.positions.size()), unsigned(mesh.indices.size() / 3));
+	for (size_t i = 0; i < mesh.positions.size(); i++) {
+		const point3 &p = mesh.positions[i];
+		out.print("v %.9g %.9g %.9g\n", p.x, p.y, p.z);
+	}
+	for (size_t i = 0; i < mesh.normals.size(); i++) {
+		const point3 &n = mesh.normals[i];
+		out.print("vn %.9g %.9g %.9g\n", n.x, n.y, n.z);
+	}
+	// OBJ counts from 1
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+		unsigned a = mesh.indices[i] + 1, b = mesh.indices[i + 1] + 1, c = mesh.indices[i + 2] + 1;
+		out.print("f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c);
+	}
+	if (bytes != NULL)
+		*bytes = out.bytes();
+	return out.close();
+}
+
+bool write_mesh(const char *filename, const TriangleMesh &mesh, size_t *bytes) {
+	size_t length = strlen(filename);
+	if (length >= 4 && strcmp(filename + length - 4, ".obj") == 0)
+		return write_obj(filename, mesh, bytes);
+	return write_ply(filename, mesh, bytes);
+}
@@ -0,0 +1,47 @@
+#ifndef MESH_EXPORT_H
+#define MESH_EXPORT_H
+
+#include "patch_mesh.h"
+#include <cstdio>
+#include <vector>
+
+// Writes a file through one large buffer of its own, so that the many small
+// pieces of a mesh file reach the disk in a few big writes. Everything is
+// written as it is produced; nothing is collected first.
+class FileWriter {
+	FILE *fp;
+	std::vector<char> buffer;
+	size_t used, total;
+	bool failed;
+	FileWriter(const FileWriter &);
+	FileWriter &operator=(const FileWriter &);
+public:
+	static const size_t buffer_size = 1 << 20;
+	FileWriter() : fp(NULL), used(0), total(0), failed(false) {}
+	~FileWriter() { close(); }
+	// False, after printing why, if the file can't be created
+	bool open(const char *filename);
+	void write(const void *data, size_t bytes);
+	template <typename T> void put(const T &value) { write(&value, sizeof(T)); }
+	// printf into the buffer. One call writes at most 256 characters.
+	void print(const char *format, ...);
+	void flush();
+	// Whether everything reached the file
+	bool close();
+	// Bytes written so far, buffered or not
+	size_t bytes() const { return total; }
+};
+
+// A mesh as binary PLY, with a normal per vertex and triangles as lists of 3.
+// The vertices and triangles go straight from the mesh's arrays into the
+// writer's buffer. bytes, if given, receives the size of the file.
+bool write_ply(const char *filename, const TriangleMesh &mesh, size_t *bytes = NULL);
+
+// A mesh as OBJ text: v and vn per vertex, and f with the same index for
+// both per triangle
+bool write_obj(const char *filename, const TriangleMesh &mesh, size_t *bytes = NULL);
+
+// write_obj for names ending in .obj, write_ply otherwise
+bool write_mesh(const char *filename, const TriangleMesh &mesh, size_t *bytes = NULL);
+
+#endif // MESH_EXPORT_H
@@ -0,0 +1,130 @@
+#include "model_loader.h"
+#include "patch_batch.h"
+#include "patch_file.h"
+#include <algorithm>
+#include <chrono>
+
+// A patch's lines fill its own part of the buffer, so the workers can split
+// the patches up freely
+void PatchModel::build(WorkerPool &workers) {
+	build_patch_matrices(points.data(), indices.data(), indices.size(), matrices);
+	lines.resize(patches.size() * BezierPatch::num_line_vertices);
+	workers.parallel_for(0, patches.size(), 64, [&](int first, int last) {
+		for (int i = first; i < last; i++)
+			patches[i].tessellate(&lines[i * BezierPatch::num_line_vertices]);
+	});
+	build_rest();
+}
+
+void PatchModel::build_rest() {
+	point_patches.build(indices.data(), indices.size(), points.size());
+	bvh.build(patches);
+	caster.build(patches, bvh);
+	cones.clear();
+	for (int i = 0; i < patches.size(); i++)
+		cones.push_back(NormalCone(patches[i]));
+	build_welded_mesh(patches, indices, num_increments, mesh);
+	orientation = (signed_volume(mesh) < 0.0) ? -1.0 : 1.0;
+}
+
+//----------------------------------------------------------------------------
+
+void ModelLoader::start(const char *filename_, WorkerPool &workers_) {
+	stop();
+	filename = filename_;
+	workers = &workers_;
+	stopping = false;
+	thread = std::thread(&ModelLoader::run, this);
+}
+
+void ModelLoader::stop() {
+	stopping = true;
+	if (thread.joinable())
+		thread.join();
+	PatchBatch *batch;
+	while (queue.pop(batch))
+		delete batch;
+}
+
+PatchBatch *ModelLoader::next() {
+	PatchBatch *batch;
+	return queue.pop(batch) ? batch : NULL;
+}
+
+void ModelLoader::take_model(PatchModel &out) {
+	std::swap(out, model);
+	out.caster.rebind(out.patches, out.bvh);
+	model.caster.rebind(model.patches, model.bvh);
+}
+
+// Wait for room while the render thread catches up, unless told to stop
+bool ModelLoader::publish(PatchBatch *batch) {
+	while (!queue.push(batch)) {
+		if (stopping) {
+			delete batch;
+			return false;
+		}
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+void ModelLoader::run() {
+	PatchFile file;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	failed = !file.load(filename.c_str());
+	load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	// The matrices and strips go straight into the model, the matrices for
+	// all of it at once, so build_rest() is all that is left at the end
+	if (!failed) {
+		from_cache = file.from_cache;
+		model.indices.assign(file.indices, file.indices + file.num_patches);
+		model.points.assign(file.points, file.points + file.num_points);
+		model.patches.reserve(file.num_patches);
+		model.lines.resize(size_t(file.num_patches) * BezierPatch::num_line_vertices);
+		build_patch_matrices(file.points, file.indices, file.num_patches, model.matrices);
+	}
+
+	for (int first = 0; !failed && first < file.num_patches; first += batch_size) {
+		PatchBatch *batch = new PatchBatch;
+		int count = std::min(batch_size, file.num_patches - first);
+		batch->first = first;
+		batch->total = file.num_patches;
+		batch->count = count;
+		batch->lines.reserve(size_t(count) * loading_line_vertices);
+
+		for (int i = first; i < first + count; i++) {
+			point3 cps[16];
+			for (int j = 0; j < 16; j++)
+				cps[j] = file.points[file.indices[i].cp_idxs[j] - 1];
+			model.patches.push_back(BezierPatch(cps, model.matrices.matrix(i, 0), model.matrices.matrix(i, 1), model.matrices.matrix(i, 2)));
+		}
+		workers->parallel_for(first, first + count, 64, [&](int from, int to) {
+			for (int i = from; i < to; i++)
+				model.patches[i].tessellate(&model.lines[size_t(i) * BezierPatch::num_line_vertices]);
+		});
+
+		// The strips again as separate segments, so any number of patches
+		// draws with one call
+		const point4 *strips = &model.lines[size_t(first) * BezierPatch::num_line_vertices];
+		for (int i = 0; i < count; i++, strips += BezierPatch::num_line_vertices) {
+			for (int s = 0; s < 2 * num_increments; s++) {
+				for (int k = 0; k + 1 < num_increments; k++) {
+					batch->lines.push_back(strips[s * num_increments + k]);
+					batch->lines.push_back(strips[s * num_increments + k + 1]);
+				}
+			}
+		}
+		if (!publish(batch))
+			return;
+	}
+
+	// The rest of the setup too, so the render thread only has GL to do
+	if (!failed)
+		model.build_rest();
+
+	PatchBatch *last = new PatchBatch;
+	last->total = failed ? 0 : file.num_patches;
+	last->last = true;
+	publish(last);
+}
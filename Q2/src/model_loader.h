@@ -0,0 +1,91 @@
+#ifndef MODEL_LOADER_H
+#define MODEL_LOADER_H
+
+#include "bezier_patch.h"
+#include "patch_batch.h"
+#include "patch_bvh.h"
+#include "patch_file.h"
+#include "patch_mesh.h"
+#include "ray_patch.h"
+#include "spsc_queue.h"
+#include "worker_pool.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A model as loaded, with everything the CPU side needs to draw, pick and
+// edit it. build() makes the rest from indices, points and patches without
+// touching GL, so it can run off the render thread.
+struct PatchModel {
+	std::vector<PatchIndex> indices;
+	std::vector<point3> points;
+	std::vector<BezierPatch> patches;
+	PointPatches point_patches;
+	PatchMatrices matrices;
+	std::vector<point4> lines; // BezierPatch::num_line_vertices per patch
+	PatchBVH bvh;
+	PatchRayCaster caster;     // over patches and bvh, so rebind it after moving them
+	std::vector<NormalCone> cones;
+	TriangleMesh mesh;         // welded, num_increments vertices along a side
+	float orientation;         // 1 if Su x Sv points out of the model, -1 if in
+	PatchModel() : orientation(1.0) {}
+	void build(WorkerPool &workers);
+	// What build() makes after the matrices and lines, for a loader that
+	// made those along with the patches
+	void build_rest();
+};
+
+// The lines of patches [first, first + count) of a model of total patches,
+// ready to draw while the rest load: every patch's lines as GL_LINES pairs,
+// loading_line_vertices of them per patch. The loader keeps the patches and
+// their strips themselves for the model. The last batch of a load has no
+// patches and last set.
+struct PatchBatch {
+	int first, count, total;
+	std::vector<point4> lines;
+	bool last;
+	PatchBatch() : first(0), count(0), total(0), last(false) {}
+};
+
+const int loading_line_vertices = 2 * num_increments * (num_increments - 1) * 2;
+
+// Loads a patch file on a thread of its own and hands the render thread the
+// patches a batch at a time through a lock-free queue, so that frames keep
+// coming while a big model loads and the model fills in as they do.
+class ModelLoader {
+	std::thread thread;
+	SpscQueue<PatchBatch *, 64> queue;
+	std::atomic<bool> stopping;
+	std::string filename;
+	WorkerPool *workers;
+	// Handed over with the last batch
+	PatchModel model;
+	bool failed, from_cache;
+	double load_ms;
+	bool publish(PatchBatch *batch);
+	void run();
+	ModelLoader(const ModelLoader &);
+	ModelLoader &operator=(const ModelLoader &);
+public:
+	static const int batch_size = 256;
+	ModelLoader() : stopping(false), workers(NULL), failed(false), from_cache(false), load_ms(0.0) {}
+	~ModelLoader() { stop(); }
+	// The render thread has to leave the workers alone until the last batch
+	// is out, since the loader builds the model with them
+	void start(const char *filename, WorkerPool &workers);
+	// Give up on a load still going, and wait for the thread
+	void stop();
+	// The next finished batch, or NULL when there is none yet. The caller
+	// deletes it.
+	PatchBatch *next();
+	// Once the last batch is out: whether the file loaded, and the model,
+	// built and swapped into the one given
+	bool succeeded() const { return !failed; }
+	void take_model(PatchModel &model);
+	// How long the file took to read, and whether it came from the cache
+	double file_ms() const { return load_ms; }
+	bool cached() const { return from_cache; }
+};
+
+#endif // MODEL_LOADER_H
@@ -0,0 +1,214 @@
+#include "patch_batch.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#  define PATCH_BATCH_SSE
+#  include <xmmintrin.h>
+#endif
+
+// Four floats, one per patch, with just the operations the batch kernels need
+#ifdef PATCH_BATCH_SSE
+struct Lanes {
+	__m128 v;
+};
+#define ALIGN_LANES alignas(16)
+static inline Lanes load_lanes(const float *p) { Lanes a; a.v = _mm_load_ps(p); return a; }
+static inline void store_lanes(float *p, Lanes a) { _mm_store_ps(p, a.v); }
+// For heap memory, which only a 64-bit heap is sure to align to 16
+static inline void store_lanes_unaligned(float *p, Lanes a) { _mm_storeu_ps(p, a.v); }
+static inline Lanes splat(float f) { Lanes a; a.v = _mm_set1_ps(f); return a; }
+static inline Lanes operator+(Lanes a, Lanes b) { a.v = _mm_add_ps(a.v, b.v); return a; }
+static inline Lanes operator-(Lanes a, Lanes b) { a.v = _mm_sub_ps(a.v, b.v); return a; }
+static inline Lanes operator*(Lanes a, Lanes b) { a.v = _mm_mul_ps(a.v, b.v); return a; }
+static inline Lanes operator/(Lanes a, Lanes b) { a.v = _mm_div_ps(a.v, b.v); return a; }
+static inline Lanes sqrt_lanes(Lanes a) { a.v = _mm_sqrt_ps(a.v); return a; }
+// Bit i set where lane i of a is at most lane i of b
+static inline int lanes_at_most(Lanes a, Lanes b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+#else
+struct Lanes {
+	float v[4];
+};
+#define ALIGN_LANES
+static inline Lanes load_lanes(const float *p) { Lanes a; for (int i = 0; i < 4; i++) a.v[i] = p[i]; return a; }
+static inline void store_lanes(float *p, Lanes a) { for (int i = 0; i < 4; i++) p[i] = a.v[i]; }
+static inline void store_lanes_unaligned(float *p, Lanes a) { store_lanes(p, a); }
+static inline Lanes splat(float f) { Lanes a; for (int i = 0; i < 4; i++) a.v[i] = f; return a; }
+static inline Lanes operator+(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+static inline Lanes operator-(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+static inline Lanes operator*(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+static inline Lanes operator/(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] /= b.v[i]; return a; }
+static inline Lanes sqrt_lanes(Lanes a) { for (int i = 0; i < 4; i++) a.v[i] = sqrt(a.v[i]); return a; }
+static inline int lanes_at_most(Lanes a, Lanes b) { int mask = 0; for (int i = 0; i < 4; i++) mask |= (a.v[i] <= b.v[i]) << i; return mask; }
+#endif
+
+// Patches built together, one 64-byte cache line of each run
+static const int patches_per_block = 16;
+
+// out = M (a, b, c, d) for the Bezier basis M, through forward differences:
+// the rows of M are the third, second (times 3) and first (times 3)
+// differences and the first point
+static inline void bezier_basis(Lanes a, Lanes b, Lanes c, Lanes d, Lanes three, Lanes out[4]) {
+	Lanes d1 = b - a, d2 = c - b, d3 = d - c;
+	Lanes dd1 = d2 - d1;
+	out[0] = (d3 - d2) - dd1;
+	out[1] = three * dd1;
+	out[2] = three * d1;
+	out[3] = a;
+}
+
+glm::mat4 PatchMatrices::matrix(int patch, int k) const {
+	glm::mat4 m;
+	for (int e = 0; e < 16; e++)
+		m[e / 4][e % 4] = run(k, e)[patch];
+	return m;
+}
+
+void PatchMatrices::set_matrix(int patch, int k, const glm::mat4 &m) {
+	for (int e = 0; e < 16; e++)
+		run(k, e)[patch] = m[e / 4][e % 4];
+}
+
+void build_patch_matrices(const point3 *points, const PatchIndex *indices, int num_patches, PatchMatrices &out) {
+	out.count = num_patches;
+	out.stride = (num_patches + patches_per_block - 1) / patches_per_block * patches_per_block;
+	out.elements.resize(size_t(48) * out.stride);
+
+	Lanes three = splat(3.0);
+
+	for (int block = 0; block < num_patches; block += patches_per_block) {
+		// The block's 48 runs are finished in local storage first, so each
+		// run is written out as one whole cache line
+		ALIGN_LANES float result[48][patches_per_block];
+
+		for (int group = 0; group < patches_per_block; group += 4) {
+			// Gather coordinate k of control point i (u row i / 4, v column
+			// i % 4) of four patches into lanes. Past the last patch the
+			// lanes repeat it, and those results land in the padding.
+			ALIGN_LANES float g[3][16][4];
+			for (int lane = 0; lane < 4; lane++) {
+				const int *cp_idxs = indices[std::min(block + group + lane, num_patches - 1)].cp_idxs;
+				for (int i = 0; i < 16; i++) {
+					const point3 &p = points[cp_idxs[i] - 1];
+					g[0][i][lane] = p.x;
+					g[1][i][lane] = p.y;
+					g[2][i][lane] = p.z;
+				}
+			}
+
+			for (int k = 0; k < 3; k++) {
+				Lanes G[16];
+				for (int i = 0; i < 16; i++)
+					G[i] = load_lanes(g[k][i]);
+
+				// A = M G one column at a time, then each row of A times M^T
+				// (the same basis, since M is symmetric) gives a row of MGM
+				Lanes A[4][4], R[4];
+				for (int c = 0; c < 4; c++)
+					bezier_basis(G[c], G[4 + c], G[8 + c], G[12 + c], three, A[c]);
+				for (int r = 0; r < 4; r++) {
+					bezier_basis(A[0][r], A[1][r], A[2][r], A[3][r], three, R);
+					for (int c = 0; c < 4; c++)
+						store_lanes(&result[k * 16 + c * 4 + r][group], R[c]);
+				}
+			}
+		}
+
+		for (int run = 0; run < 48; run++)
+			for (int group = 0; group < patches_per_block; group += 4)
+				store_lanes_unaligned(&out.elements[size_t(run) * out.stride + block + group], load_lanes(&result[run][group]));
+	}
+}
+
+void evaluate_patch_grids(const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const int *list, int count, int n,
+	point3 *positions, point3 *normals) {
+	// Row i of the parameter table is (t^3, t^2, t, 1) at t = i / (n - 1), and
+	// row i of the derivative table is its derivative. u and v share both.
+	const float h = 1.0f / (n - 1);
+	std::vector<float> T(4 * n), dT(4 * n);
+	for (int i = 0; i < n; i++) {
+		float t = i * h;
+		T[4 * i] = t * t * t;    T[4 * i + 1] = t * t;     T[4 * i + 2] = t;    T[4 * i + 3] = 1.0f;
+		dT[4 * i] = 3.0f * t * t; dT[4 * i + 1] = 2.0f * t; dT[4 * i + 2] = 1.0f; dT[4 * i + 3] = 0.0f;
+	}
+	const int vertices_per_grid = n * n;
+
+	for (int group = 0; group < count; group += 4) {
+		// B[k][r][c] = MGM[c][r] of coordinate k for four patches, the last
+		// one repeated past the end of the list
+		int lanes = std::min(count - group, 4);
+		ALIGN_LANES float g[3][4][4][4];
+		for (int lane = 0; lane < 4; lane++) {
+			int patch = list[group + std::min(lane, lanes - 1)];
+			for (int k = 0; k < 3; k++)
+				for (int e = 0; e < 16; e++)
+					g[k][e % 4][e / 4][lane] = matrices.run(k, e)[patch];
+		}
+		Lanes B[3][4][4];
+		for (int k = 0; k < 3; k++)
+			for (int r = 0; r < 4; r++)
+				for (int c = 0; c < 4; c++)
+					B[k][r][c] = load_lanes(g[k][r][c]);
+
+		for (int column = 0; column < n; column += grid_columns_per_block) {
+			int columns = std::min(grid_columns_per_block, n - column);
+
+			// The right-hand products for this block of columns, B V^T and
+			// B dV^T, which every row of the grid reuses
+			Lanes BV[3][4][grid_columns_per_block], BdV[3][4][grid_columns_per_block];
+			for (int j = 0; j < columns; j++) {
+				const float *V = &T[4 * (column + j)], *dV = &dT[4 * (column + j)];
+				for (int k = 0; k < 3; k++) {
+					for (int r = 0; r < 4; r++) {
+						BV[k][r][j] = B[k][r][0] * splat(V[0]) + B[k][r][1] * splat(V[1]) + B[k][r][2] * splat(V[2]) + B[k][r][3];
+						BdV[k][r][j] = B[k][r][0] * splat(dV[0]) + B[k][r][1] * splat(dV[1]) + B[k][r][2];
+					}
+				}
+			}
+
+			// Then the left-hand products, one row of the tables at a time:
+			// position U B V^T, Su = dU B V^T and Sv = U B dV^T
+			for (int i = 0; i < n; i++) {
+				Lanes U[4], dU[3];
+				for (int r = 0; r < 4; r++)
+					U[r] = splat(T[4 * i + r]);
+				for (int r = 0; r < 3; r++)
+					dU[r] = splat(dT[4 * i + r]);
+				for (int j = 0; j < columns; j++) {
+					Lanes p[3], su[3], sv[3];
+					for (int k = 0; k < 3; k++) {
+						p[k] = U[0] * BV[k][0][j] + U[1] * BV[k][1][j] + U[2] * BV[k][2][j] + BV[k][3][j];
+						su[k] = dU[0] * BV[k][0][j] + dU[1] * BV[k][1][j] + BV[k][2][j];
+						sv[k] = U[0] * BdV[k][0][j] + U[1] * BdV[k][1][j] + U[2] * BdV[k][2][j] + BdV[k][3][j];
+					}
+					Lanes normal[3] = {
+						su[1] * sv[2] - su[2] * sv[1],
+						su[2] * sv[0] - su[0] * sv[2],
+						su[0] * sv[1] - su[1] * sv[0]
+					};
+					Lanes length2 = normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2];
+					Lanes su2 = su[0] * su[0] + su[1] * su[1] + su[2] * su[2];
+					Lanes sv2 = sv[0] * sv[0] + sv[1] * sv[1] + sv[2] * sv[2];
+					int degenerate = lanes_at_most(length2, splat(1e-12f) * su2 * sv2);
+					Lanes inverse_length = splat(1.0f) / sqrt_lanes(length2);
+
+					ALIGN_LANES float out[6][4];
+					for (int k = 0; k < 3; k++) {
+						store_lanes(out[k], p[k]);
+						store_lanes(out[3 + k], normal[k] * inverse_length);
+					}
+					int vertex = i * n + column + j;
+					for (int lane = 0; lane < lanes; lane++) {
+						size_t at = size_t(group + lane) * vertices_per_grid + vertex;
+						if (degenerate & (1 << lane))
+							patches[list[group + lane]].patch_point_normal(i * h, (column + j) * h, positions[at], normals[at]);
+						else {
+							positions[at] = point3(out[0][lane], out[1][lane], out[2][lane]);
+							normals[at] = point3(out[3][lane], out[4][lane], out[5][lane]);
+						}
+					}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef PATCH_BATCH_H
+#define PATCH_BATCH_H
+
+#include "bezier_patch.h"
+#include <vector>
+
+// The MGM matrices of many patches, stored as structure of arrays: each of
+// the 48 matrix elements (3 coordinates x 16, column-major like glm) is one
+// contiguous run over all patches. Runs are padded to a multiple of 4 patches
+// so the builder can always write 4 at once.
+class PatchMatrices {
+public:
+	int count, stride;
+	std::vector<float> elements;
+	PatchMatrices() : count(0), stride(0) {}
+	// Element e (column * 4 + row) of coordinate k, for every patch
+	float *run(int k, int e) { return &elements[(k * 16 + e) * stride]; }
+	const float *run(int k, int e) const { return &elements[(k * 16 + e) * stride]; }
+	// Gather one patch's matrix for coordinate k back into a glm::mat4
+	glm::mat4 matrix(int patch, int k) const;
+	// And scatter one back in, for a patch that has changed
+	void set_matrix(int patch, int k, const glm::mat4 &m);
+	size_t bytes() const { return elements.size() * sizeof(float); }
+};
+
+// Build M G M^T for x, y and z of num_patches patches in one pass, four
+// patches per step in SSE registers where available. indices are 1-based
+// into points, as loaded from a patch file. The only allocation is out's
+// storage, which is reused when it is already large enough.
+void build_patch_matrices(const point3 *points, const PatchIndex *indices, int num_patches, PatchMatrices &out);
+
+// Grid columns evaluate_patch_grids keeps the right-hand products of at once
+static const int grid_columns_per_block = 16;
+
+// Positions and unit normals of the listed patches over n x n grids, laid out
+// as evaluate_grid lays out one patch, the patch in slot s of the list at
+// [s * n * n, (s + 1) * n * n). Every patch shares the same parameter rows, so
+// with U and V tables of (t^3, t^2, t, 1) at the n grid parameters the grid
+// of a coordinate is the matrix product U MGM V^T, and the tangents swap in
+// the derivative tables. The products are done four patches to a register,
+// B V^T for a block of grid columns first and then each row of U against
+// that, so the working set stays in L1 whatever n is. Poles fall back to
+// patches' patch_point_normal.
+void evaluate_patch_grids(const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const int *list, int count, int n,
+	point3 *positions, point3 *normals);
+
+#endif // PATCH_BATCH_H
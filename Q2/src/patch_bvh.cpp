@@ -0,0 +1,193 @@
+#include "patch_bvh.h"
+#include <algorithm>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+// Patches per leaf
+static const int leaf_size = 4;
+
+// Gribb and Hartmann: each plane is the last row of the matrix plus or minus
+// one of the others
+Frustum::Frustum(const glm::mat4 &m) {
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; i++)
+		row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+	for (int i = 0; i < 3; i++) {
+		planes[2 * i] = row[3] + row[i];
+		planes[2 * i + 1] = row[3] - row[i];
+	}
+}
+
+// Test the corner furthest along each plane's normal, which is outside only
+// if the whole box is, and the nearest corner, which is inside only if the
+// whole box is
+int Frustum::classify(const Bounds &b) const {
+	int result = Inside;
+	for (int i = 0; i < 6; i++) {
+		const glm::vec4 &p = planes[i];
+		point3 far_corner(p.x > 0 ? b.hi.x : b.lo.x, p.y > 0 ? b.hi.y : b.lo.y, p.z > 0 ? b.hi.z : b.lo.z);
+		if (dot(point3(p), far_corner) + p.w < 0)
+			return Outside;
+		point3 near_corner(p.x > 0 ? b.lo.x : b.hi.x, p.y > 0 ? b.lo.y : b.hi.y, p.z > 0 ? b.lo.z : b.hi.z);
+		if (dot(point3(p), near_corner) + p.w < 0)
+			result = Partly;
+	}
+	return result;
+}
+
+static const float binomial[6][6] = {
+	{ 1 }, { 1, 1 }, { 1, 2, 1 }, { 1, 3, 3, 1 }, { 1, 4, 6, 4, 1 }, { 1, 5, 10, 10, 5, 1 }
+};
+
+// Su is a degree (2,3) Bezier patch over the u differences of the control
+// points and Sv a degree (3,2) one over the v differences, so Su x Sv is a
+// degree (5,5) patch whose 36 coefficients are positive combinations of
+// their cross products. Every normal lies in the cone around those.
+NormalCone::NormalCone(const BezierPatch &patch) : axis(0.0), half_angle(-1.0f), center(0.0), radius(0.0f) {
+	const point3 *P = patch.cps;
+	point3 N[6][6];
+	for (int k = 0; k < 6; k++)
+		for (int l = 0; l < 6; l++)
+			N[k][l] = point3(0.0);
+	for (int a = 0; a < 3; a++) {
+		for (int b = 0; b < 4; b++) {
+			point3 du = P[(a + 1) * 4 + b] - P[a * 4 + b];
+			for (int c = 0; c < 4; c++) {
+				for (int d = 0; d < 3; d++) {
+					point3 dv = P[c * 4 + d + 1] - P[c * 4 + d];
+					float weight = binomial[2][a] * binomial[3][c] / binomial[5][a + c]
+						* binomial[3][b] * binomial[2][d] / binomial[5][b + d];
+					N[a + c][b + d] += weight * cross(du, dv);
+				}
+			}
+		}
+	}
+
+	// Zero coefficients, where a boundary collapses to a pole, point nowhere
+	point3 sum(0.0);
+	for (int k = 0; k < 6; k++)
+		for (int l = 0; l < 6; l++)
+			if (dot(N[k][l], N[k][l]) > 1e-20f)
+				sum += normalize(N[k][l]);
+	if (dot(sum, sum) > 1e-20f) {
+		axis = normalize(sum);
+		float min_cos = 1.0;
+		for (int k = 0; k < 6; k++)
+			for (int l = 0; l < 6; l++)
+				if (dot(N[k][l], N[k][l]) > 1e-20f)
+					min_cos = std::min(min_cos, dot(axis, normalize(N[k][l])));
+		half_angle = (min_cos > 0.0f) ? acos(std::min(min_cos, 1.0f)) : -1.0f;
+	}
+
+	Bounds box;
+	for (int i = 0; i < 16; i++)
+		box.grow(P[i]);
+	center = box.center();
+	for (int i = 0; i < 16; i++)
+		radius = std::max(radius, distance(center, P[i]));
+}
+
+// Seen from eye, the sphere covers directions within asin(radius / distance)
+// of its centre. The patch faces away when the outward cone and that one are
+// entirely more than 90 degrees apart.
+bool NormalCone::back_facing(const point3 &eye, float orientation) const {
+	if (half_angle < 0.0f)
+		return false;
+	point3 to_eye = eye - center;
+	float eye_distance = length(to_eye);
+	if (eye_distance <= radius)
+		return false;
+	float spread = half_angle + asin(radius / eye_distance);
+	if (spread >= 0.5f * glm::pi<float>())
+		return false;
+	return orientation * dot(axis, to_eye) / eye_distance < -sin(spread);
+}
+
+void PatchBVH::build(const std::vector<BezierPatch> &patches) {
+	std::vector<Bounds> patch_bounds(patches.size());
+	for (int i = 0; i < patches.size(); i++)
+		for (int j = 0; j < 16; j++)
+			patch_bounds[i].grow(patches[i].cps[j]);
+
+	order.resize(patches.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = i;
+	nodes.clear();
+	nodes.reserve(2 * patches.size() / leaf_size + 1);
+	split(patch_bounds, 0, order.size());
+}
+
+// Children always come after their parent, so going backwards finishes both
+// children before the parent that unites them
+void PatchBVH::refit(const std::vector<BezierPatch> &patches) {
+	for (int index = int(nodes.size()) - 1; index >= 0; index--) {
+		Node &node = nodes[index];
+		node.bounds = Bounds();
+		if (node.right < 0) {
+			for (int i = node.first; i < node.first + node.count; i++)
+				for (int j = 0; j < 16; j++)
+					node.bounds.grow(patches[order[i]].cps[j]);
+		}
+		else {
+			node.bounds.grow(nodes[index + 1].bounds);
+			node.bounds.grow(nodes[node.right].bounds);
+		}
+	}
+}
+
+// Add the node for order[first, first + count), splitting it at the median
+// along the longest axis of the patch centres. Returns the node's index.
+int PatchBVH::split(std::vector<Bounds> &patch_bounds, int first, int count) {
+	int index = nodes.size();
+	nodes.push_back(Node());
+	Bounds bounds, centers;
+	for (int i = first; i < first + count; i++) {
+		bounds.grow(patch_bounds[order[i]]);
+		centers.grow(patch_bounds[order[i]].center());
+	}
+	nodes[index].bounds = bounds;
+	nodes[index].first = first;
+	nodes[index].count = count;
+	nodes[index].right = -1;
+	if (count <= leaf_size)
+		return index;
+
+	point3 extent = centers.hi - centers.lo;
+	int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	int half = count / 2;
+	std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+		[&](int a, int b) { return patch_bounds[a].center()[axis] < patch_bounds[b].center()[axis]; });
+
+	split(patch_bounds, first, half);
+	int right = split(patch_bounds, first + half, count - half);
+	nodes[index].right = right;
+	return index;
+}
+
+void PatchBVH::cull(const Frustum &frustum, std::vector<int> &visible, CullStats &stats) const {
+	size_t start = visible.size();
+	stats = CullStats();
+	if (nodes.empty())
+		return;
+
+	int stack[64];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		const Node &node = nodes[stack[--depth]];
+		stats.nodes_visited++;
+		int inside = frustum.classify(node.bounds);
+		if (inside == Frustum::Outside)
+			continue;
+		if (inside == Frustum::Inside || node.right < 0) {
+			visible.insert(visible.end(), order.begin() + node.first, order.begin() + node.first + node.count);
+			continue;
+		}
+		stack[depth++] = node.right;
+		stack[depth++] = &node - &nodes[0] + 1;
+	}
+	std::sort(visible.begin() + start, visible.end());
+	stats.visible = visible.size() - start;
+	stats.culled = order.size() - stats.visible;
+}
@@ -0,0 +1,75 @@
+#ifndef PATCH_BVH_H
+#define PATCH_BVH_H
+
+#include "bezier_patch.h"
+#include <vector>
+
+// An axis-aligned box, empty until something is added to it
+struct Bounds {
+	point3 lo, hi;
+	Bounds() : lo(1e30f), hi(-1e30f) {}
+	void grow(const point3 &p) { lo = glm::min(lo, p); hi = glm::max(hi, p); }
+	void grow(const Bounds &b) { lo = glm::min(lo, b.lo); hi = glm::max(hi, b.hi); }
+	point3 center() const { return (lo + hi) * 0.5f; }
+};
+
+// The six planes bounding what a model-view-projection matrix can see, in the
+// space it transforms from
+class Frustum {
+	glm::vec4 planes[6]; // inside where dot(plane, (p, 1)) >= 0
+public:
+	explicit Frustum(const glm::mat4 &model_view_projection);
+	enum { Outside = 0, Partly = 1, Inside = 2 };
+	int classify(const Bounds &b) const;
+};
+
+// How a frame's culling went. culled counts patches outside the frustum, and
+// back_facing those inside it that face away.
+struct CullStats {
+	int visible, culled, back_facing, nodes_visited;
+	CullStats() : visible(0), culled(0), back_facing(0), nodes_visited(0) {}
+};
+
+// A cone around every normal direction (Su x Sv) of a patch, and a sphere
+// around the patch itself, for telling when none of it can face the eye
+class NormalCone {
+	point3 axis;
+	float half_angle; // radians; negative when the normals span too wide to cull
+	point3 center;
+	float radius;
+public:
+	NormalCone() : axis(0.0), half_angle(-1.0), center(0.0), radius(0.0) {}
+	explicit NormalCone(const BezierPatch &patch);
+	// True if every point of the patch faces away from eye. orientation is 1
+	// when Su x Sv points out of the model and -1 when it points in.
+	bool back_facing(const point3 &eye, float orientation) const;
+};
+
+// A bounding volume hierarchy over patches. A patch lies inside the convex
+// hull of its 16 control points, so the box around them bounds it.
+class PatchBVH {
+public:
+	struct Node {
+		Bounds bounds;
+		int first, count; // range of order, for a leaf
+		int right;        // second child of an inner node; the first is next
+	};
+private:
+	std::vector<Node> nodes;
+	std::vector<int> order; // patch numbers, grouped by leaf
+	int split(std::vector<Bounds> &patch_bounds, int first, int count);
+public:
+	void build(const std::vector<BezierPatch> &patches);
+	// Recompute every box after patches have moved, keeping the tree as it is.
+	// Cheaper than build, but the tree only stays good while the moves are small.
+	void refit(const std::vector<BezierPatch> &patches);
+	const Bounds &bounds() const { return nodes[0].bounds; }
+	// Nodes depth first from the root at 0, for other traversals
+	const std::vector<Node> &tree() const { return nodes; }
+	int leaf_patch(const Node &leaf, int i) const { return order[leaf.first + i]; }
+	// Append every patch whose box is at least partly inside the frustum to
+	// visible, in ascending order. Subtrees entirely inside are taken whole.
+	void cull(const Frustum &frustum, std::vector<int> &visible, CullStats &stats) const;
+};
+
+#endif // PATCH_BVH_H
@@ -0,0 +1,229 @@
+#include "patch_chunks.h"
+#include <algorithm>
+#include <cstring>
+
+// Start of a chunked file, followed by num_chunks PatchChunk
+struct ChunkFileHeader {
+	char magic[4];
+	unsigned int version;
+	int num_chunks, num_patches;
+	Bounds bounds;
+};
+static const char chunk_magic[4] = { 'B', 'P', 'C', 'K' };
+static const unsigned int chunk_version = 1;
+
+// Chunked files outgrow what a long can seek over on some platforms
+static bool seek(FILE *fp, long long offset, int origin) {
+#ifdef _WIN32
+	return _fseeki64(fp, offset, origin) == 0;
+#else
+	return fseeko(fp, off_t(offset), origin) == 0;
+#endif
+}
+
+static long long tell(FILE *fp) {
+#ifdef _WIN32
+	return _ftelli64(fp);
+#else
+	return ftello(fp);
+#endif
+}
+
+// The bits of x spread out to every third bit
+static unsigned int spread_bits(unsigned int x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+//----------------------------------------------------------------------------
+
+bool write_chunked_model(const char *filename, const PatchFile &model, int patches_per_chunk) {
+	patches_per_chunk = std::max(patches_per_chunk, 1);
+	std::vector<Bounds> patch_bounds(model.num_patches);
+	Bounds centres;
+	for (int i = 0; i < model.num_patches; i++) {
+		for (int j = 0; j < 16; j++)
+			patch_bounds[i].grow(model.points[model.indices[i].cp_idxs[j] - 1]);
+		centres.grow(patch_bounds[i].center());
+	}
+
+	// A 30-bit Morton code over the box of the centres above the patch number
+	std::vector<unsigned long long> order(model.num_patches);
+	point3 extent = glm::max(centres.hi - centres.lo, point3(1e-20f));
+	for (int i = 0; i < model.num_patches; i++) {
+		point3 cell = (patch_bounds[i].center() - centres.lo) / extent * 1023.0f;
+		unsigned int code = spread_bits((unsigned int)cell.x) | (spread_bits((unsigned int)cell.y) << 1)
+			| (spread_bits((unsigned int)cell.z) << 2);
+		order[i] = ((unsigned long long)code << 32) | (unsigned int)i;
+	}
+	std::sort(order.begin(), order.end());
+
+	// Value-initialized, so reserved fields and any padding are zero too
+	ChunkFileHeader header = ChunkFileHeader();
+	memcpy(header.magic, chunk_magic, 4);
+	header.version = chunk_version;
+	header.num_patches = model.num_patches;
+	header.num_chunks = (model.num_patches + patches_per_chunk - 1) / patches_per_chunk;
+	std::vector<PatchChunk> chunks(header.num_chunks);
+
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to write %s\n", filename);
+		return false;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+	// The table goes in once the chunks' bounds and offsets are known
+	long long offset = sizeof(header) + sizeof(PatchChunk) * chunks.size();
+	bool ok = seek(fp, offset, SEEK_SET);
+	for (int c = 0; ok && c < header.num_chunks; c++) {
+		PatchChunk &chunk = chunks[c];
+		chunk = PatchChunk();
+		chunk.offset = offset;
+		chunk.count = std::min(patches_per_chunk, model.num_patches - c * patches_per_chunk);
+		for (int i = 0; ok && i < chunk.count; i++) {
+			int patch = int(order[c * patches_per_chunk + i] & 0xffffffffu);
+			point3 cps[16];
+			for (int j = 0; j < 16; j++)
+				cps[j] = model.points[model.indices[patch].cp_idxs[j] - 1];
+			ok = fwrite(cps, sizeof(cps), 1, fp) == 1;
+			chunk.bounds.grow(patch_bounds[patch]);
+		}
+		header.bounds.grow(chunk.bounds);
+		offset += sizeof(point3) * 16 * chunk.count;
+	}
+	ok = ok && seek(fp, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, fp) == 1
+		&& (chunks.empty() || fwrite(&chunks[0], sizeof(PatchChunk), chunks.size(), fp) == chunks.size());
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) {
+		remove(filename);
+		fprintf(stderr, "Failed to write %s\n", filename);
+	}
+	return ok;
+}
+
+//----------------------------------------------------------------------------
+
+bool ChunkedPatchFile::open(const char *filename) {
+	close();
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Load_chunks: Can't open %s\n", filename);
+		return false;
+	}
+	long long size = (seek(fp, 0, SEEK_END)) ? tell(fp) : -1;
+	ChunkFileHeader header;
+	bool ok = seek(fp, 0, SEEK_SET) && fread(&header, sizeof(header), 1, fp) == 1
+		&& memcmp(header.magic, chunk_magic, 4) == 0 && header.version == chunk_version
+		&& header.num_chunks >= 0 && header.num_patches >= 0
+		&& (long long)sizeof(header) + (long long)sizeof(PatchChunk) * header.num_chunks <= size;
+	if (ok) {
+		chunks_.resize(header.num_chunks);
+		ok = chunks_.empty() || fread(&chunks_[0], sizeof(PatchChunk), chunks_.size(), fp) == chunks_.size();
+	}
+	long long patches = 0;
+	for (int c = 0; ok && c < chunks_.size(); c++) {
+		const PatchChunk &chunk = chunks_[c];
+		ok = chunk.count >= 0 && chunk.offset >= 0 && chunk.offset + (long long)sizeof(point3) * 16 * chunk.count <= size;
+		patches += chunk.count;
+	}
+	if (!ok || patches != header.num_patches) {
+		fprintf(stderr, "Load_chunks: %s is not a chunked patch file, or is damaged\n", filename);
+		close();
+		return false;
+	}
+	bounds_ = header.bounds;
+	num_patches_ = header.num_patches;
+	return true;
+}
+
+void ChunkedPatchFile::close() {
+	if (fp != NULL)
+		fclose(fp);
+	fp = NULL;
+	chunks_.clear();
+	bounds_ = Bounds();
+	num_patches_ = 0;
+}
+
+bool ChunkedPatchFile::read_chunk(int chunk, point3 *cps) const {
+	const PatchChunk &c = chunks_[chunk];
+	return seek(fp, c.offset, SEEK_SET) && fread(cps, sizeof(point3) * 16, c.count, fp) == size_t(c.count);
+}
+
+//----------------------------------------------------------------------------
+
+void PatchChunkCache::open(const ChunkedPatchFile &file_, size_t budget_bytes) {
+	file = &file_;
+	budget = budget_bytes;
+	used = 0;
+	lru.clear();
+	where.assign(file->chunks().size(), lru.end());
+	frame = 0;
+	stats = Stats();
+	total_loaded = total_evicted = 0;
+}
+
+// Make room by dropping the least recently drawn chunks, short of any drawn
+// this frame: those are all at the front, so the back being one means the
+// rest are too
+bool PatchChunkCache::page_in(int chunk) {
+	int count = file->chunks()[chunk].count;
+	size_t bytes = sizeof(point4) * BezierPatch::num_line_vertices * size_t(count);
+	while (used + bytes > budget && !lru.empty() && lru.back().last_used != frame) {
+		where[lru.back().chunk] = lru.end();
+		used -= sizeof(point4) * lru.back().lines.size();
+		lru.pop_back();
+		stats.evicted++;
+		total_evicted++;
+	}
+	if (used + bytes > budget)
+		return false;
+
+	scratch.resize(16 * size_t(count));
+	if (count > 0 && !file->read_chunk(chunk, &scratch[0]))
+		return false;
+	lru.push_front(Resident());
+	Resident &resident = lru.front();
+	resident.chunk = chunk;
+	resident.lines.resize(BezierPatch::num_line_vertices * size_t(count));
+	for (int i = 0; i < count; i++)
+		BezierPatch(&scratch[16 * i]).tessellate(&resident.lines[BezierPatch::num_line_vertices * i]);
+	where[chunk] = lru.begin();
+	used += bytes;
+	stats.loaded++;
+	total_loaded++;
+	return true;
+}
+
+void PatchChunkCache::gather(const Frustum &frustum, const point3 &eye, std::vector<const Resident *> &visible) {
+	frame++;
+	stats = Stats();
+	visible.clear();
+	in_view.clear();
+	const std::vector<PatchChunk> &chunks = file->chunks();
+	for (int c = 0; c < chunks.size(); c++) {
+		if (frustum.classify(chunks[c].bounds) == Frustum::Outside)
+			continue;
+		point3 to_eye = chunks[c].bounds.center() - eye;
+		in_view.push_back(std::make_pair(dot(to_eye, to_eye), c));
+	}
+	std::sort(in_view.begin(), in_view.end());
+	stats.in_view = in_view.size();
+
+	for (int i = 0; i < in_view.size(); i++) {
+		int c = in_view[i].second;
+		if (where[c] != lru.end())
+			lru.splice(lru.begin(), lru, where[c]);
+		else if (stats.loaded == max_loads_per_frame || !page_in(c)) {
+			stats.skipped++;
+			continue;
+		}
+		where[c]->last_used = frame;
+		visible.push_back(&*where[c]);
+	}
+	stats.drawn = visible.size();
+}
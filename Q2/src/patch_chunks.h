@@ -0,0 +1,99 @@
+#ifndef PATCH_CHUNKS_H
+#define PATCH_CHUNKS_H
+
+#include "bezier_patch.h"
+#include "patch_bvh.h"
+#include "patch_file.h"
+#include <cstdio>
+#include <list>
+#include <vector>
+
+// A model split into chunks of neighbouring patches for drawing out of core.
+// Each chunk holds its patches' 16 control points apiece rather than indices
+// into shared points, so it can be read on its own. The file is a header,
+// a table of the chunks, and then every chunk's points, all in the byte
+// order of the machine that wrote it.
+struct PatchChunk {
+	Bounds bounds;
+	long long offset; // of the chunk's points in the file
+	int count;        // patches
+	int reserved;
+};
+
+// Write a model as a chunked file. The patches are put in order along a
+// Morton curve through their centres and cut into runs of patches_per_chunk,
+// so each chunk covers a compact piece of space. Apart from the model itself
+// this only keeps that order in memory. False, after printing why, if the
+// file can't be written.
+bool write_chunked_model(const char *filename, const PatchFile &model, int patches_per_chunk);
+
+// A chunked file, open for reading chunks as they are wanted. Only the table
+// is read when it opens.
+class ChunkedPatchFile {
+	FILE *fp;
+	std::vector<PatchChunk> chunks_;
+	Bounds bounds_;
+	int num_patches_;
+	ChunkedPatchFile(const ChunkedPatchFile &);
+	ChunkedPatchFile &operator=(const ChunkedPatchFile &);
+public:
+	ChunkedPatchFile() : fp(NULL), num_patches_(0) {}
+	~ChunkedPatchFile() { close(); }
+	// False, after printing why, if the file is missing or malformed
+	bool open(const char *filename);
+	void close();
+	const std::vector<PatchChunk> &chunks() const { return chunks_; }
+	const Bounds &bounds() const { return bounds_; }
+	int num_patches() const { return num_patches_; }
+	// The 16 control points of each of the chunk's patches, into cps
+	bool read_chunk(int chunk, point3 *cps) const;
+};
+
+// The chunks of a ChunkedPatchFile that are in memory, tessellated into
+// lines. Chunks are read and tessellated when they come into view and stay
+// until the room is needed, when the least recently drawn go first, so the
+// lines held never add up to more than the budget however big the model.
+class PatchChunkCache {
+public:
+	struct Resident {
+		int chunk;
+		std::vector<point4> lines; // BezierPatch::num_line_vertices per patch, as tessellate() makes them
+		unsigned int last_used;    // frame
+	};
+	struct Stats {
+		int in_view, drawn, loaded, evicted, skipped;
+		Stats() : in_view(0), drawn(0), loaded(0), evicted(0), skipped(0) {}
+	};
+	// Disk reads a frame may wait for. Chunks past this are left for the
+	// frames after, so turning to a new part of the model never stalls one
+	// frame for long.
+	static const int max_loads_per_frame = 16;
+private:
+	const ChunkedPatchFile *file;
+	size_t budget, used;
+	std::list<Resident> lru; // most recently drawn first
+	std::vector<std::list<Resident>::iterator> where; // lru.end() for a chunk not in memory
+	unsigned int frame;
+	Stats stats;
+	long long total_loaded, total_evicted;
+	std::vector<std::pair<float, int> > in_view;
+	std::vector<point3> scratch; // the control points of the chunk being read
+	bool page_in(int chunk);
+public:
+	PatchChunkCache() : file(NULL), budget(0), used(0), frame(0), total_loaded(0), total_evicted(0) {}
+	// The file has to outlive the cache
+	void open(const ChunkedPatchFile &file, size_t budget_bytes);
+	// The chunks at least partly inside the frustum, nearest to eye first,
+	// paged in as needed. Those that won't fit in the budget alongside the
+	// nearer ones are left out, and so are those past max_loads_per_frame.
+	void gather(const Frustum &frustum, const point3 &eye, std::vector<const Resident *> &visible);
+	const Stats &last_frame() const { return stats; }
+	size_t bytes_used() const { return used; }
+	size_t budget_bytes() const { return budget; }
+	int resident() const { return lru.size(); }
+	// Chunks read and dropped since the cache opened
+	long long loads() const { return total_loaded; }
+	long long evictions() const { return total_evicted; }
+};
+
+#endif // PATCH_CHUNKS_H
@@ -0,0 +1,312 @@
+#include "patch_file.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------
+
+#ifdef _WIN32
+MappedFile::MappedFile() : data_(NULL), size_(0), file_handle(INVALID_HANDLE_VALUE), mapping(NULL) {}
+
+bool MappedFile::open(const char *filename) {
+	close();
+	file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_handle, &size)) {
+		close();
+		return false;
+	}
+	size_ = size_t(size.QuadPart);
+	if (size_ == 0)
+		return true;
+	mapping = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL)
+		data_ = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data_ == NULL) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+	if (data_ != NULL)
+		UnmapViewOfFile(data_);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	data_ = NULL;
+	size_ = 0;
+	mapping = NULL;
+	file_handle = INVALID_HANDLE_VALUE;
+}
+#else
+MappedFile::MappedFile() : data_(NULL), size_(0) {}
+
+bool MappedFile::open(const char *filename) {
+	close();
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+	size_ = size_t(info.st_size);
+	if (size_ > 0) {
+		void *data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			::close(fd);
+			size_ = 0;
+			return false;
+		}
+		madvise(data, size_, MADV_SEQUENTIAL);
+		data_ = (const char *)data;
+	}
+	// The mapping keeps the file alive on its own
+	::close(fd);
+	return true;
+}
+
+void MappedFile::close() {
+	if (data_ != NULL)
+		munmap((void *)data_, size_);
+	data_ = NULL;
+	size_ = 0;
+}
+#endif
+
+//----------------------------------------------------------------------------
+
+// Reads the numbers of the text format in order, skipping the commas and
+// whitespace between them. The mapping is not null-terminated, so every read
+// stops at end.
+class TextScanner {
+	const char *begin, *p, *end;
+	static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+	void skip_separators() {
+		while (p < end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+			p++;
+	}
+	bool read_sign() {
+		bool negative = p < end && *p == '-';
+		if (p < end && (*p == '-' || *p == '+'))
+			p++;
+		return negative;
+	}
+public:
+	TextScanner(const char *begin_, const char *end_) : begin(begin_), p(begin_), end(end_) {}
+	long offset() const { return long(p - begin); }
+	bool next_int(int &value) {
+		skip_separators();
+		bool negative = read_sign();
+		if (p == end || !is_digit(*p))
+			return false;
+		int n = 0;
+		while (p < end && is_digit(*p))
+			n = n * 10 + (*p++ - '0');
+		value = negative ? -n : n;
+		return true;
+	}
+	bool next_float(float &value) {
+		skip_separators();
+		bool negative = read_sign();
+		double mantissa = 0.0;
+		int exponent = 0;
+		bool digits = false;
+		for (; p < end && is_digit(*p); p++, digits = true)
+			mantissa = mantissa * 10.0 + (*p - '0');
+		if (p < end && *p == '.') {
+			for (p++; p < end && is_digit(*p); p++, digits = true, exponent--)
+				mantissa = mantissa * 10.0 + (*p - '0');
+		}
+		if (!digits)
+			return false;
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			p++;
+			int e;
+			if (!next_int(e))
+				return false;
+			exponent += e;
+		}
+		value = float(exponent == 0 ? mantissa : mantissa * pow(10.0, exponent));
+		if (negative)
+			value = -value;
+		return true;
+	}
+};
+
+// Start of the cache file, followed by num_patches PatchIndex and then
+// num_points point3, all in the byte order of the machine that wrote it
+struct PatchCacheHeader {
+	char magic[4];
+	unsigned int version;
+	long long source_size, source_mtime; // of the text file it was made from
+	int num_patches, num_points;
+};
+static const char cache_magic[4] = { 'B', 'P', 'C', 'H' };
+static const unsigned int cache_version = 1;
+
+static bool source_stamp(const char *filename, long long &size, long long &mtime) {
+	struct stat info;
+	if (stat(filename, &info) != 0)
+		return false;
+	size = info.st_size;
+	mtime = info.st_mtime;
+	return true;
+}
+
+bool PatchFile::map_cache(const char *cache_name, const char *filename) {
+	long long size, mtime;
+	if (!source_stamp(filename, size, mtime) || !cache.open(cache_name))
+		return false;
+
+	PatchCacheHeader header;
+	if (cache.size() >= sizeof(header)) {
+		memcpy(&header, cache.data(), sizeof(header));
+		size_t expected = sizeof(header) + sizeof(PatchIndex) * size_t(header.num_patches) + sizeof(point3) * size_t(header.num_points);
+		if (memcmp(header.magic, cache_magic, 4) == 0 && header.version == cache_version
+			&& header.source_size == size && header.source_mtime == mtime
+			&& header.num_patches >= 0 && header.num_points >= 0 && cache.size() == expected) {
+			num_patches = header.num_patches;
+			num_points = header.num_points;
+			indices = (const PatchIndex *)(cache.data() + sizeof(header));
+			points = (const point3 *)(indices + num_patches);
+			return true;
+		}
+	}
+	// Stale, or from another version or machine
+	cache.close();
+	return false;
+}
+
+static bool malformed(const char *filename, const TextScanner &scan) {
+	fprintf(stderr, "Load_patch: %s is malformed near byte %ld\n", filename, scan.offset());
+	return false;
+}
+
+bool PatchFile::parse_text(const char *filename) {
+	MappedFile text;
+	if (!text.open(filename)) {
+		fprintf(stderr, "Load_patch: Can't open %s\n", filename);
+		return false;
+	}
+	TextScanner scan(text.data(), text.data() + text.size());
+
+	// Every number takes at least two bytes, so the counts can be checked
+	// against the file size before anything is allocated for them
+	if (!scan.next_int(num_patches) || num_patches < 0 || size_t(num_patches) * 16 * 2 > text.size())
+		return malformed(filename, scan);
+	parsed_indices.resize(num_patches);
+	for (int i = 0; i < num_patches; i++)
+		for (int j = 0; j < 16; j++)
+			if (!scan.next_int(parsed_indices[i].cp_idxs[j]))
+				return malformed(filename, scan);
+
+	if (!scan.next_int(num_points) || num_points < 0 || size_t(num_points) * 3 * 2 > text.size())
+		return malformed(filename, scan);
+	parsed_points.resize(num_points);
+	for (int i = 0; i < num_points; i++)
+		for (int j = 0; j < 3; j++)
+			if (!scan.next_float(parsed_points[i][j]))
+				return malformed(filename, scan);
+
+	for (int i = 0; i < num_patches; i++) {
+		for (int j = 0; j < 16; j++) {
+			int index = parsed_indices[i].cp_idxs[j];
+			if (index < 1 || index > num_points) {
+				fprintf(stderr, "Load_patch: patch %d of %s uses point %d, but there are %d\n", i + 1, filename, index, num_points);
+				return false;
+			}
+		}
+	}
+
+	indices = parsed_indices.empty() ? NULL : &parsed_indices[0];
+	points = parsed_points.empty() ? NULL : &parsed_points[0];
+	return true;
+}
+
+// Written under a temporary name and renamed into place, so a reader never
+// maps a half-written cache. A cache that can't be written is only a slower
+// next start.
+void PatchFile::write_cache(const char *cache_name, const char *filename) const {
+	PatchCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_magic, 4);
+	header.version = cache_version;
+	header.num_patches = num_patches;
+	header.num_points = num_points;
+	if (!source_stamp(filename, header.source_size, header.source_mtime))
+		return;
+
+	std::string temp_name = std::string(cache_name) + ".tmp";
+	FILE *fp = fopen(temp_name.c_str(), "wb");
+	if (fp == NULL)
+		return;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(indices, sizeof(PatchIndex), num_patches, fp) == size_t(num_patches)
+		&& fwrite(points, sizeof(point3), num_points, fp) == size_t(num_points);
+	ok = (fclose(fp) == 0) && ok;
+	remove(cache_name);
+	if (!ok || rename(temp_name.c_str(), cache_name) != 0)
+		remove(temp_name.c_str());
+}
+
+bool PatchFile::load(const char *filename) {
+	std::string cache_name = std::string(filename) + ".cache";
+	from_cache = map_cache(cache_name.c_str(), filename);
+	if (from_cache)
+		return true;
+	if (!parse_text(filename))
+		return false;
+	write_cache(cache_name.c_str(), filename);
+	return true;
+}
+
+// One pass counts each point's patches and a second, over the running totals,
+// places them. last holds the latest patch seen for each point, so that a
+// patch using a point more than once counts it once.
+void PointPatches::build(const PatchIndex *indices, int num_patches, int num_points) {
+	starts.assign(num_points + 1, 0);
+	std::vector<int> last(num_points, -1);
+	for (int p = 0; p < num_patches; p++) {
+		for (int j = 0; j < 16; j++) {
+			int point = indices[p].cp_idxs[j] - 1;
+			if (last[point] != p) {
+				last[point] = p;
+				starts[point + 1]++;
+			}
+		}
+	}
+	for (int i = 0; i < num_points; i++)
+		starts[i + 1] += starts[i];
+
+	patches.resize(starts[num_points]);
+	std::vector<int> next(starts.begin(), starts.end() - 1);
+	last.assign(num_points, -1);
+	for (int p = 0; p < num_patches; p++) {
+		for (int j = 0; j < 16; j++) {
+			int point = indices[p].cp_idxs[j] - 1;
+			if (last[point] != p) {
+				last[point] = p;
+				patches[next[point]++] = p;
+			}
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef PATCH_FILE_H
+#define PATCH_FILE_H
+
+#include "bezier_patch.h"
+#include <cstddef>
+#include <vector>
+
+// A whole file mapped read-only into memory
+class MappedFile {
+	const char *data_;
+	size_t size_;
+#ifdef _WIN32
+	void *file_handle, *mapping;
+#endif
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+public:
+	MappedFile();
+	~MappedFile() { close(); }
+	bool open(const char *filename);
+	void close();
+	const char *data() const { return data_; }
+	size_t size() const { return size_; }
+};
+
+// A model in the teapot patch format: the number of patches, a row of 16
+// 1-based control point indices per patch, the number of points, then x, y, z
+// per point.
+//
+// The first load parses the text straight out of a mapping of the file and
+// writes a binary copy next to it (<filename>.cache). Later loads map the
+// cache instead, and indices and points point into that mapping, so they stay
+// valid only as long as the PatchFile does.
+class PatchFile {
+	MappedFile cache;
+	std::vector<PatchIndex> parsed_indices;
+	std::vector<point3> parsed_points;
+	bool map_cache(const char *cache_name, const char *filename);
+	bool parse_text(const char *filename);
+	void write_cache(const char *cache_name, const char *filename) const;
+public:
+	int num_patches, num_points;
+	const PatchIndex *indices;
+	const point3 *points;
+	bool from_cache;
+	PatchFile() : num_patches(0), num_points(0), indices(NULL), points(NULL), from_cache(false) {}
+	// False, after printing why, if the file is missing or malformed
+	bool load(const char *filename);
+};
+
+// The patches that use each control point, in compressed sparse row form: the
+// patches of point i (0-based) are patches[starts[i]] to patches[starts[i + 1] - 1],
+// in ascending order and each listed once even where a pole repeats the point
+class PointPatches {
+	std::vector<int> starts, patches;
+public:
+	void build(const PatchIndex *indices, int num_patches, int num_points);
+	int count(int point) const { return starts[point + 1] - starts[point]; }
+	const int *begin(int point) const { return patches.data() + starts[point]; }
+	const int *end(int point) const { return patches.data() + starts[point + 1]; }
+};
+
+#endif // PATCH_FILE_H
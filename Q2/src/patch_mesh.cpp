@@ -0,0 +1,442 @@
+#include "patch_mesh.h"
+#include "patch_subdivide.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
+
+// Positions in cp_idxs of the control points along each boundary, in the
+// direction of increasing parameter
+static const int boundary_cps[4][4] = {
+	{ 0, 1, 2, 3 },     // u = 0, along v
+	{ 12, 13, 14, 15 }, // u = 1, along v
+	{ 0, 4, 8, 12 },    // v = 0, along u
+	{ 3, 7, 11, 15 }    // v = 1, along u
+};
+
+static int gcd(int a, int b) {
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+GLuint PatchVertexWelder::add_vertex(int patch, float u, float v) {
+	point3 position, normal;
+	patches[patch].patch_point_normal(u, v, position, normal);
+	mesh.positions.push_back(position);
+	mesh.normals.push_back(normal);
+	return mesh.positions.size() - 1;
+}
+
+GLuint PatchVertexWelder::boundary_vertex(int patch, int i, int j, int den) {
+	int boundary, k;
+	if (i == 0)        { boundary = 0; k = j; }
+	else if (i == den) { boundary = 1; k = j; }
+	else if (j == 0)   { boundary = 2; k = i; }
+	else               { boundary = 3; k = i; }
+
+	const int *cps = indices[patch].cp_idxs;
+	int e[4];
+	for (int n = 0; n < 4; n++)
+		e[n] = cps[boundary_cps[boundary][n]];
+
+	Key key;
+	if (k == 0 || k == den || (e[0] == e[1] && e[1] == e[2] && e[2] == e[3])) {
+		key.a = (k == den) ? e[3] : e[0];
+		key.b = key.c = key.d = -1;
+		key.num = 0;
+		key.den = 1;
+	}
+	else {
+		// Both neighbours walk the boundary in the direction of the smaller
+		// index sequence, so they agree on the position along it
+		if (e[3] < e[0] || (e[3] == e[0] && e[2] < e[1])) {
+			std::swap(e[0], e[3]);
+			std::swap(e[1], e[2]);
+			k = den - k;
+		}
+		int g = gcd(k, den);
+		key.a = e[0];
+		key.b = e[1];
+		key.c = e[2];
+		key.d = e[3];
+		key.num = k / g;
+		key.den = den / g;
+	}
+
+	std::unordered_map<Key, GLuint, KeyHash>::iterator found = shared.find(key);
+	if (found != shared.end())
+		return found->second;
+
+	GLuint vertex = add_vertex(patch, float(i) / den, float(j) / den);
+	shared[key] = vertex;
+	return vertex;
+}
+
+// Append a triangle unless two of its corners were welded together
+static void add_triangle(TriangleMesh &mesh, GLuint a, GLuint b, GLuint c) {
+	if (a == b || b == c || a == c)
+		return;
+	mesh.indices.push_back(a);
+	mesh.indices.push_back(b);
+	mesh.indices.push_back(c);
+}
+
+// Whether every edge of the mesh is shared by two triangles. An edge used
+// once is a boundary, where the inside of the surface can be seen
+static bool is_closed(const TriangleMesh &mesh) {
+	std::unordered_map<unsigned long long, int> edges;
+	for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+		for (int k = 0; k < 3; k++) {
+			unsigned long long a = mesh.indices[t + k], b = mesh.indices[t + (k + 1) % 3];
+			if (a > b)
+				std::swap(a, b);
+			edges[(a << 32) | b]++;
+		}
+	}
+	for (std::unordered_map<unsigned long long, int>::const_iterator e = edges.begin(); e != edges.end(); ++e)
+		if (e->second == 1)
+			return false;
+	return true;
+}
+
+void build_welded_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, int n, TriangleMesh &mesh) {
+	PatchVertexWelder welder(patches, indices, mesh);
+	int den = n - 1;
+	std::vector<GLuint> grid(n * n);
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+	mesh.patch_starts.clear();
+	mesh.grid_vertices.clear();
+	mesh.patch_vertex_starts.clear();
+	for (int p = 0; p < patches.size(); p++) {
+		mesh.patch_starts.push_back(mesh.indices.size());
+		mesh.patch_vertex_starts.push_back(mesh.positions.size());
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				if (i == 0 || j == 0 || i == den || j == den)
+					grid[i * n + j] = welder.boundary_vertex(p, i, j, den);
+				else
+					grid[i * n + j] = welder.add_vertex(p, float(i) / den, float(j) / den);
+			}
+		}
+		mesh.grid_vertices.insert(mesh.grid_vertices.end(), grid.begin(), grid.end());
+
+		// Counter-clockwise in (u,v), so front faces follow Su x Sv
+		for (int i = 0; i < den; i++) {
+			for (int j = 0; j < den; j++) {
+				GLuint v00 = grid[i * n + j], v10 = grid[(i + 1) * n + j];
+				GLuint v01 = grid[i * n + j + 1], v11 = grid[(i + 1) * n + j + 1];
+				add_triangle(mesh, v00, v10, v11);
+				add_triangle(mesh, v00, v11, v01);
+			}
+		}
+	}
+	mesh.patch_starts.push_back(mesh.indices.size());
+	mesh.patch_vertex_starts.push_back(mesh.positions.size());
+	mesh.closed = is_closed(mesh);
+}
+
+// The grid is walked in the same order as when it was built, so a vertex that
+// a collapsed boundary repeats is evaluated where it was first made
+void update_welded_patch(const std::vector<BezierPatch> &patches, int patch, int n, TriangleMesh &mesh) {
+	const GLuint *grid = &mesh.grid_vertices[size_t(patch) * n * n];
+	GLuint first = mesh.patch_vertex_starts[patch], last = mesh.patch_vertex_starts[patch + 1];
+	std::vector<bool> done(last - first, false);
+	int den = n - 1;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			GLuint vertex = grid[i * n + j];
+			if (vertex < first || vertex >= last || done[vertex - first])
+				continue;
+			done[vertex - first] = true;
+			patches[patch].patch_point_normal(float(i) / den, float(j) / den, mesh.positions[vertex], mesh.normals[vertex]);
+		}
+	}
+}
+
+float signed_volume(const TriangleMesh &mesh) {
+	double volume = 0.0;
+	for (int i = 0; i + 2 < mesh.indices.size(); i += 3) {
+		const point3 &a = mesh.positions[mesh.indices[i]];
+		const point3 &b = mesh.positions[mesh.indices[i + 1]];
+		const point3 &c = mesh.positions[mesh.indices[i + 2]];
+		volume += dot(a, cross(b, c));
+	}
+	return float(volume / 6.0);
+}
+
+void tessellate_grids(const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const std::vector<int> &list,
+	int first, int last, int n, TriangleMesh &mesh) {
+	if (first >= last)
+		return;
+	evaluate_patch_grids(matrices, patches, &list[first], last - first, n, &mesh.positions[size_t(first) * n * n], &mesh.normals[size_t(first) * n * n]);
+	for (int s = first; s < last; s++) {
+		GLuint base = s * n * n;
+
+		// Counter-clockwise in (u,v), as in build_welded_mesh
+		GLuint *out = &mesh.indices[size_t(s) * grid_indices(n)];
+		for (int i = 0; i < n - 1; i++) {
+			for (int j = 0; j < n - 1; j++) {
+				GLuint v00 = base + i * n + j, v10 = v00 + n;
+				*out++ = v00; *out++ = v10;     *out++ = v10 + 1;
+				*out++ = v00; *out++ = v10 + 1; *out++ = v00 + 1;
+			}
+		}
+	}
+}
+
+void build_grid_mesh(WorkerPool &pool, const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const std::vector<int> &list,
+	int n, TriangleMesh &mesh) {
+	mesh.positions.resize(list.size() * n * n);
+	mesh.normals.resize(list.size() * n * n);
+	mesh.indices.resize(list.size() * grid_indices(n));
+	pool.parallel_for(0, list.size(), 64, [&](int first, int last) {
+		tessellate_grids(matrices, patches, list, first, last, n, mesh);
+	});
+}
+
+static point2 to_screen(const glm::mat4 &model_view_projection, const glm::vec2 &viewport, const point3 &p) {
+	point4 clip = model_view_projection * point4(p, 1.0);
+	return point2(clip) / std::max(clip.w, 1e-3f) * 0.5f * viewport;
+}
+
+// Segments for a boundary, from the screen length of its control polygon.
+// Summed the same way in either direction so that both neighbours agree.
+static int boundary_level(const BezierPatch &patch, int boundary, const glm::mat4 &model_view_projection,
+	const glm::vec2 &viewport, float pixels_per_segment) {
+	point2 p[4];
+	for (int n = 0; n < 4; n++)
+		p[n] = to_screen(model_view_projection, viewport, patch.cps[boundary_cps[boundary][n]]);
+	float pixels = (distance(p[0], p[1]) + distance(p[2], p[3])) + distance(p[1], p[2]);
+	return std::min(std::max(int(ceil(pixels / pixels_per_segment)), 1), 64);
+}
+
+// Triangulate the strip between a boundary (outer, parameters outer_t) and the
+// parallel row of inner vertices (inner, parameters inner_t), always advancing
+// along whichever side has the nearer next vertex
+static void zip_strip(TriangleMesh &mesh, const std::vector<GLuint> &outer, const std::vector<float> &outer_t,
+	const std::vector<GLuint> &inner, const std::vector<float> &inner_t, bool flip) {
+	int a = 0, b = 0;
+	while (a < outer.size() - 1 || b < inner.size() - 1) {
+		bool advance_outer;
+		if (a == outer.size() - 1)      advance_outer = false;
+		else if (b == inner.size() - 1) advance_outer = true;
+		else                            advance_outer = outer_t[a + 1] <= inner_t[b + 1];
+
+		GLuint v0 = outer[a], v1 = advance_outer ? outer[a + 1] : inner[b + 1], v2 = inner[b];
+		if (flip)
+			add_triangle(mesh, v0, v2, v1);
+		else
+			add_triangle(mesh, v0, v1, v2);
+
+		if (advance_outer) a++;
+		else               b++;
+	}
+}
+
+void build_adaptive_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, const std::vector<int> &list,
+	const glm::mat4 &model_view_projection, const glm::vec2 &viewport, float pixels_per_segment, TriangleMesh &mesh) {
+	PatchVertexWelder welder(patches, indices, mesh);
+	std::vector<GLuint> inner, outer, inner_row;
+	std::vector<float> outer_t, inner_t;
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+	for (int s = 0; s < list.size(); s++) {
+		int p = list[s];
+		int level[4];
+		for (int boundary = 0; boundary < 4; boundary++)
+			level[boundary] = boundary_level(patches[p], boundary, model_view_projection, viewport, pixels_per_segment);
+
+		// At least 2 so that there is always an inner vertex to stitch to
+		int level_u = std::max(std::max(level[2], level[3]), 2);
+		int level_v = std::max(std::max(level[0], level[1]), 2);
+
+		// Inner vertices (i, j) for 0 < i < level_u, 0 < j < level_v
+		int inner_u = level_u - 1, inner_v = level_v - 1;
+		inner.resize(inner_u * inner_v);
+		for (int i = 0; i < inner_u; i++)
+			for (int j = 0; j < inner_v; j++)
+				inner[i * inner_v + j] = welder.add_vertex(p, float(i + 1) / level_u, float(j + 1) / level_v);
+
+		for (int i = 0; i < inner_u - 1; i++) {
+			for (int j = 0; j < inner_v - 1; j++) {
+				GLuint v00 = inner[i * inner_v + j], v10 = inner[(i + 1) * inner_v + j];
+				GLuint v01 = inner[i * inner_v + j + 1], v11 = inner[(i + 1) * inner_v + j + 1];
+				add_triangle(mesh, v00, v10, v11);
+				add_triangle(mesh, v00, v11, v01);
+			}
+		}
+
+		// Stitch each boundary to the nearest inner row or column. Boundaries
+		// 0 and 1 run along v at u = 0 and 1, boundaries 2 and 3 along u.
+		for (int boundary = 0; boundary < 4; boundary++) {
+			int e = level[boundary];
+			bool along_v = boundary < 2;
+			outer.clear();
+			outer_t.clear();
+			for (int k = 0; k <= e; k++) {
+				int side = (boundary % 2 == 0) ? 0 : e;
+				outer.push_back(along_v ? welder.boundary_vertex(p, side, k, e) : welder.boundary_vertex(p, k, side, e));
+				outer_t.push_back(float(k) / e);
+			}
+
+			inner_row.clear();
+			inner_t.clear();
+			int count = along_v ? inner_v : inner_u;
+			for (int k = 0; k < count; k++) {
+				int i = along_v ? ((boundary == 0) ? 0 : inner_u - 1) : k;
+				int j = along_v ? k : ((boundary == 2) ? 0 : inner_v - 1);
+				inner_row.push_back(inner[i * inner_v + j]);
+				inner_t.push_back(float(k + 1) / (along_v ? level_v : level_u));
+			}
+
+			// Counter-clockwise in (u,v) for v = 0 and u = 1, mirrored otherwise
+			zip_strip(mesh, outer, outer_t, inner_row, inner_t, boundary == 0 || boundary == 3);
+		}
+	}
+}
+
+typedef std::tuple<int, int, int, int> BoundaryKey;
+
+// A boundary that is all one control point, like the poles of the lid
+static bool collapsed(const BoundaryKey &key) {
+	return std::get<0>(key) == std::get<1>(key) && std::get<1>(key) == std::get<2>(key) && std::get<2>(key) == std::get<3>(key);
+}
+
+// The control point indices along a patch boundary, in the direction the
+// welder walks it in whichever patch it is seen from. Returns true when that
+// runs against the patch's own parameter.
+static bool shared_boundary(const PatchIndex &index, int boundary, BoundaryKey &key) {
+	int e[4];
+	for (int n = 0; n < 4; n++)
+		e[n] = index.cp_idxs[boundary_cps[boundary][n]];
+	bool reversed = e[3] < e[0] || (e[3] == e[0] && e[2] < e[1]);
+	if (reversed) {
+		std::swap(e[0], e[3]);
+		std::swap(e[1], e[2]);
+	}
+	key = BoundaryKey(e[0], e[1], e[2], e[3]);
+	return reversed;
+}
+
+static void sort_unique(std::vector<int> &values) {
+	std::sort(values.begin(), values.end());
+	values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+void build_subdivided_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, const std::vector<int> &list,
+	float tolerance, TriangleMesh &mesh) {
+	PatchVertexWelder welder(patches, indices, mesh);
+	const int den = subdivision_steps;
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	// Subdivide every patch first, so that each shared boundary can collect
+	// the corners both of its patches put on it
+	std::vector<std::vector<PatchRegion> > regions(list.size());
+	std::map<BoundaryKey, std::vector<int> > boundary_points;
+	for (int s = 0; s < list.size(); s++) {
+		int p = list[s];
+		subdivide_patch(patches[p].cps, tolerance, regions[s]);
+		for (int boundary = 0; boundary < 4; boundary++) {
+			BoundaryKey key;
+			bool reversed = shared_boundary(indices[p], boundary, key);
+			if (collapsed(key))
+				continue; // the welder makes one vertex of it anyway
+			std::vector<int> &points = boundary_points[key];
+			for (int r = 0; r < regions[s].size(); r++) {
+				const PatchRegion &region = regions[s][r];
+				bool on = (boundary == 0) ? region.u0 == 0 : (boundary == 1) ? region.u1 == den
+					: (boundary == 2) ? region.v0 == 0 : region.v1 == den;
+				if (!on)
+					continue;
+				int a = (boundary < 2) ? region.v0 : region.u0, b = (boundary < 2) ? region.v1 : region.u1;
+				points.push_back(reversed ? den - a : a);
+				points.push_back(reversed ? den - b : b);
+			}
+		}
+	}
+
+	std::map<int, std::vector<int> > at_u, at_v;
+	std::unordered_map<int, GLuint> inner;
+	std::vector<GLuint> perimeter;
+	for (int s = 0; s < list.size(); s++) {
+		int p = list[s];
+
+		// The corners on each line of constant u (listing their v) and of
+		// constant v, so that a piece's edges pick up its neighbours' corners
+		at_u.clear();
+		at_v.clear();
+		for (int r = 0; r < regions[s].size(); r++) {
+			const PatchRegion &region = regions[s][r];
+			int us[2] = { region.u0, region.u1 }, vs[2] = { region.v0, region.v1 };
+			for (int k = 0; k < 2; k++) {
+				at_u[us[k]].insert(at_u[us[k]].end(), vs, vs + 2);
+				at_v[vs[k]].insert(at_v[vs[k]].end(), us, us + 2);
+			}
+		}
+		for (int boundary = 0; boundary < 4; boundary++) {
+			BoundaryKey key;
+			bool reversed = shared_boundary(indices[p], boundary, key);
+			if (collapsed(key))
+				continue;
+			const std::vector<int> &points = boundary_points[key];
+			std::vector<int> &line = (boundary == 0) ? at_u[0] : (boundary == 1) ? at_u[den] : (boundary == 2) ? at_v[0] : at_v[den];
+			for (int k = 0; k < points.size(); k++)
+				line.push_back(reversed ? den - points[k] : points[k]);
+		}
+		for (std::map<int, std::vector<int> >::iterator line = at_u.begin(); line != at_u.end(); ++line)
+			sort_unique(line->second);
+		for (std::map<int, std::vector<int> >::iterator line = at_v.begin(); line != at_v.end(); ++line)
+			sort_unique(line->second);
+
+		// Interior points are shared within the patch by their position,
+		// boundary points with the neighbours through the welder
+		inner.clear();
+		auto vertex = [&](int i, int j) -> GLuint {
+			if (i == 0 || j == 0 || i == den || j == den)
+				return welder.boundary_vertex(p, i, j, den);
+			std::unordered_map<int, GLuint>::iterator found = inner.find(i * (den + 1) + j);
+			if (found != inner.end())
+				return found->second;
+			GLuint v = welder.add_vertex(p, float(i) / den, float(j) / den);
+			inner[i * (den + 1) + j] = v;
+			return v;
+		};
+
+		for (int r = 0; r < regions[s].size(); r++) {
+			const PatchRegion &region = regions[s][r];
+			// Counter-clockwise in (u,v), as in build_welded_mesh: up u along
+			// v0, up v along u1, back down u along v1 and down v along u0
+			perimeter.clear();
+			const std::vector<int> &bottom = at_v[region.v0], &right = at_u[region.u1];
+			const std::vector<int> &top = at_v[region.v1], &left = at_u[region.u0];
+			for (std::vector<int>::const_iterator i = std::lower_bound(bottom.begin(), bottom.end(), region.u0); *i < region.u1; ++i)
+				perimeter.push_back(vertex(*i, region.v0));
+			for (std::vector<int>::const_iterator j = std::lower_bound(right.begin(), right.end(), region.v0); *j < region.v1; ++j)
+				perimeter.push_back(vertex(region.u1, *j));
+			for (std::vector<int>::const_iterator i = std::upper_bound(top.begin(), top.end(), region.u1); *(i - 1) > region.u0; --i)
+				perimeter.push_back(vertex(*(i - 1), region.v1));
+			for (std::vector<int>::const_iterator j = std::upper_bound(left.begin(), left.end(), region.v1); *(j - 1) > region.v0; --j)
+				perimeter.push_back(vertex(region.u0, *(j - 1)));
+
+			if (perimeter.size() == 4) {
+				add_triangle(mesh, perimeter[0], perimeter[1], perimeter[2]);
+				add_triangle(mesh, perimeter[0], perimeter[2], perimeter[3]);
+				continue;
+			}
+			GLuint middle = welder.add_vertex(p, float(region.u0 + region.u1) / (2 * den), float(region.v0 + region.v1) / (2 * den));
+			for (int k = 0; k < perimeter.size(); k++)
+				add_triangle(mesh, middle, perimeter[k], perimeter[(k + 1) % perimeter.size()]);
+		}
+	}
+}
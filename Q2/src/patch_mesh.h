@@ -0,0 +1,111 @@
+#ifndef PATCH_MESH_H
+#define PATCH_MESH_H
+
+#include "bezier_patch.h"
+#include "patch_batch.h"
+#include "worker_pool.h"
+#include <unordered_map>
+
+// An indexed triangle mesh with a unit normal per vertex. Positions leave
+// out w, which the vertex attribute defaults to 1.
+struct TriangleMesh {
+	std::vector<point3> positions;
+	std::vector<point3> normals;
+	std::vector<GLuint> indices;
+	std::vector<GLuint> patch_starts; // welded meshes: where each patch's triangles start in indices, then the end
+	std::vector<GLuint> grid_vertices; // welded meshes: each patch's n x n grid of vertices, patch after patch
+	std::vector<GLuint> patch_vertex_starts; // welded meshes: where the vertices each patch added start, then the end
+	bool closed = false; // welded meshes: every edge is shared by two triangles, so no inside shows through
+};
+
+// Hands out mesh vertices for points of patch (u,v) grids so that neighbouring
+// patches reuse each other's boundary vertices instead of duplicating them.
+//
+// Patches share a boundary when the four control point indices along it are
+// the same, in either direction. Corners are shared by their control point
+// index, and a boundary whose four indices are all one control point (the
+// poles of the lid and bottom) collapses to that single vertex.
+class PatchVertexWelder {
+	struct Key {
+		int a, b, c, d; // control point indices along the boundary, or a alone for a corner
+		int num, den;   // position along the boundary, as a reduced fraction
+		bool operator==(const Key &o) const {
+			return a == o.a && b == o.b && c == o.c && d == o.d && num == o.num && den == o.den;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key &k) const {
+			size_t h = k.a;
+			h = h * 31 + k.b;
+			h = h * 31 + k.c;
+			h = h * 31 + k.d;
+			h = h * 31 + k.num;
+			return h * 31 + k.den;
+		}
+	};
+	std::unordered_map<Key, GLuint, KeyHash> shared;
+	const std::vector<BezierPatch> &patches;
+	const std::vector<PatchIndex> &indices;
+	TriangleMesh &mesh;
+public:
+	PatchVertexWelder(const std::vector<BezierPatch> &patches_, const std::vector<PatchIndex> &indices_, TriangleMesh &mesh_)
+		: patches(patches_), indices(indices_), mesh(mesh_) {}
+	// Append a vertex evaluated at (u,v) on the given patch
+	GLuint add_vertex(int patch, float u, float v);
+	// The vertex at grid point (i,j) of a den x den grid over the patch, where
+	// i or j is 0 or den. Created on first use, shared afterwards.
+	GLuint boundary_vertex(int patch, int i, int j, int den);
+};
+
+// Tessellate every patch into a grid of n x n vertices and weld the grids into
+// one indexed triangle mesh. Triangles that lose their area to a collapsed
+// boundary are dropped. Each patch's triangles are contiguous, so a subset of
+// patches can be drawn from patch_starts.
+void build_welded_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, int n, TriangleMesh &mesh);
+
+// Evaluate the vertices a patch added to a mesh from build_welded_mesh again,
+// after the patch has changed. A boundary vertex belongs to the first patch
+// that reached it and takes its normal from that one, so the result is what
+// build_welded_mesh would give, as long as every changed patch is updated.
+void update_welded_patch(const std::vector<BezierPatch> &patches, int patch, int n, TriangleMesh &mesh);
+
+// The volume a closed mesh encloses, positive when its triangles wind
+// counter-clockwise seen from outside. For a mesh from build_welded_mesh the
+// sign says whether Su x Sv points out of the model or into it.
+float signed_volume(const TriangleMesh &mesh);
+
+// The listed patches each tessellated into their own n x n grid, with nothing
+// shared, so the patch in slot s of the list owns vertices [s * n * n,
+// (s + 1) * n * n) and indices [s * grid_indices(n), (s + 1) * grid_indices(n))
+// whatever the others do
+inline int grid_indices(int n) { return (n - 1) * (n - 1) * 6; }
+
+// Fill slots [first, last) of a grid mesh whose arrays are already sized for
+// the whole list. Separate ranges can be filled from separate threads. The
+// grids come from evaluate_patch_grids, so matrices has to hold the same
+// patches' MGMs.
+void tessellate_grids(const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const std::vector<int> &list,
+	int first, int last, int n, TriangleMesh &mesh);
+
+// Size mesh for the grids of the listed patches and fill it across the pool
+void build_grid_mesh(WorkerPool &pool, const PatchMatrices &matrices, const std::vector<BezierPatch> &patches, const std::vector<int> &list,
+	int n, TriangleMesh &mesh);
+
+// Tessellate the listed patches at levels chosen from its size on screen, about one
+// segment per pixels_per_segment pixels. Each boundary's level comes from its
+// own four control points alone, so neighbours agree on it and share its
+// vertices; the patch interior follows the finer of each pair of opposite
+// boundaries and is stitched to the boundaries without T-junctions.
+void build_adaptive_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, const std::vector<int> &list,
+	const glm::mat4 &model_view_projection, const glm::vec2 &viewport, float pixels_per_segment, TriangleMesh &mesh);
+
+// Subdivide the listed patches with subdivide_patch until each piece is
+// within tolerance of the two triangles between its corners, and weld the
+// pieces into one mesh. Flat parts get a few large pieces and curved parts
+// many small ones. Where a piece's edge has a neighbour's corners along it,
+// in the same patch or across a shared boundary, the piece is instead fanned
+// from its middle through all of them, so there are no T-junctions to crack.
+void build_subdivided_mesh(const std::vector<BezierPatch> &patches, const std::vector<PatchIndex> &indices, const std::vector<int> &list,
+	float tolerance, TriangleMesh &mesh);
+
+#endif // PATCH_MESH_H
@@ -0,0 +1,145 @@
+#include "patch_subdivide.h"
+#include <algorithm>
+
+void split_curve(const point3 in[4], float t, point3 low[4], point3 high[4]) {
+	point3 p01 = glm::mix(in[0], in[1], t), p12 = glm::mix(in[1], in[2], t), p23 = glm::mix(in[2], in[3], t);
+	point3 p012 = glm::mix(p01, p12, t), p123 = glm::mix(p12, p23, t);
+	point3 p = glm::mix(p012, p123, t);
+	low[0] = in[0]; low[1] = p01;  low[2] = p012;  low[3] = p;
+	high[0] = p;    high[1] = p123; high[2] = p23; high[3] = in[3];
+}
+
+// Split at b keeping the left part, then split that at a / b keeping the right
+void curve_segment(const point3 in[4], float a, float b, point3 out[4]) {
+	point3 p[4] = { in[0], in[1], in[2], in[3] };
+	for (int level = 1; level < 4; level++)
+		for (int i = 3; i >= level; i--)
+			p[i] = glm::mix(p[i - 1], p[i], b);
+	float s = (b > 0.0f) ? a / b : 0.0f;
+	for (int level = 1; level < 4; level++)
+		for (int i = 0; i < 4 - level; i++)
+			p[i] = glm::mix(p[i], p[i + 1], s);
+	for (int i = 0; i < 4; i++)
+		out[i] = p[i];
+}
+
+void sub_patch(const point3 cps[16], float u0, float u1, float v0, float v1, point3 out[16]) {
+	point3 rows[16];
+	for (int i = 0; i < 4; i++)
+		curve_segment(&cps[4 * i], v0, v1, &rows[4 * i]);
+	for (int j = 0; j < 4; j++) {
+		point3 column[4] = { rows[j], rows[4 + j], rows[8 + j], rows[12 + j] };
+		point3 segment[4];
+		curve_segment(column, u0, u1, segment);
+		for (int i = 0; i < 4; i++)
+			out[4 * i + j] = segment[i];
+	}
+}
+
+void split_patch_u(const point3 cps[16], float u, point3 low[16], point3 high[16]) {
+	for (int j = 0; j < 4; j++) {
+		point3 column[4] = { cps[j], cps[4 + j], cps[8 + j], cps[12 + j] };
+		point3 below[4], above[4];
+		split_curve(column, u, below, above);
+		for (int i = 0; i < 4; i++) {
+			low[4 * i + j] = below[i];
+			high[4 * i + j] = above[i];
+		}
+	}
+}
+
+void split_patch_v(const point3 cps[16], float v, point3 low[16], point3 high[16]) {
+	for (int i = 0; i < 4; i++)
+		split_curve(&cps[4 * i], v, &low[4 * i], &high[4 * i]);
+}
+
+void split_patch(const point3 cps[16], float u, float v, point3 out[4][16]) {
+	point3 low[16], high[16];
+	split_patch_u(cps, u, low, high);
+	split_patch_v(low, v, out[0], out[1]);
+	split_patch_v(high, v, out[2], out[3]);
+}
+
+// How far the middle two points of a control polygon are from a third and two
+// thirds of the way along its chord
+static float chord_distance(const point3 &p0, const point3 &p1, const point3 &p2, const point3 &p3) {
+	return std::max(distance(p1, glm::mix(p0, p3, 1.0f / 3.0f)), distance(p2, glm::mix(p0, p3, 2.0f / 3.0f)));
+}
+
+Flatness patch_flatness(const point3 cps[16]) {
+	const point3 &c00 = cps[0], &c01 = cps[3], &c10 = cps[12], &c11 = cps[15];
+	float deviation = 0.0f;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			point3 quad = glm::mix(glm::mix(c00, c01, j / 3.0f), glm::mix(c10, c11, j / 3.0f), i / 3.0f);
+			deviation = std::max(deviation, distance(cps[4 * i + j], quad));
+		}
+	}
+
+	Flatness f;
+	f.along_u = f.along_v = 0.0f;
+	for (int k = 0; k < 4; k++) {
+		f.along_v = std::max(f.along_v, chord_distance(cps[4 * k], cps[4 * k + 1], cps[4 * k + 2], cps[4 * k + 3]));
+		f.along_u = std::max(f.along_u, chord_distance(cps[k], cps[4 + k], cps[8 + k], cps[12 + k]));
+	}
+	f.error = deviation + 0.25f * length(c00 - c01 - c10 + c11);
+	return f;
+}
+
+void subdivide_patch(const point3 cps[16], float tolerance, std::vector<PatchRegion> &regions) {
+	struct Piece {
+		point3 cps[16];
+		PatchRegion region;
+		int depth_u, depth_v;
+	};
+	std::vector<Piece> pending(1);
+	std::copy(cps, cps + 16, pending[0].cps);
+	PatchRegion whole = { 0, 0, subdivision_steps, subdivision_steps };
+	pending[0].region = whole;
+	pending[0].depth_u = pending[0].depth_v = 0;
+
+	while (!pending.empty()) {
+		Piece piece = pending.back();
+		pending.pop_back();
+		Flatness f = patch_flatness(piece.cps);
+		bool can_u = piece.depth_u < max_subdivision_depth, can_v = piece.depth_v < max_subdivision_depth;
+		if (f.error <= tolerance || (!can_u && !can_v)) {
+			regions.push_back(piece.region);
+			continue;
+		}
+
+		// Halve across whichever direction bends more, or both when they bend
+		// about as much, which includes a net that only twists
+		bool split_u = can_u && (!can_v || f.along_u >= 0.5f * f.along_v);
+		bool split_v = can_v && (!can_u || f.along_v >= 0.5f * f.along_u);
+		Piece halves[2];
+		int count = 1;
+		halves[0] = piece;
+		if (split_u) {
+			int middle = (piece.region.u0 + piece.region.u1) / 2;
+			split_patch_u(piece.cps, 0.5f, halves[0].cps, halves[1].cps);
+			halves[1].region = halves[0].region = piece.region;
+			halves[0].region.u1 = halves[1].region.u0 = middle;
+			halves[0].depth_u = halves[1].depth_u = piece.depth_u + 1;
+			halves[1].depth_v = piece.depth_v;
+			count = 2;
+		}
+		for (int h = 0; h < count; h++) {
+			if (split_v) {
+				Piece quarters[2];
+				int middle = (halves[h].region.v0 + halves[h].region.v1) / 2;
+				split_patch_v(halves[h].cps, 0.5f, quarters[0].cps, quarters[1].cps);
+				for (int q = 0; q < 2; q++) {
+					quarters[q].region = halves[h].region;
+					quarters[q].depth_u = halves[h].depth_u;
+					quarters[q].depth_v = halves[h].depth_v + 1;
+				}
+				quarters[0].region.v1 = quarters[1].region.v0 = middle;
+				pending.push_back(quarters[0]);
+				pending.push_back(quarters[1]);
+			}
+			else
+				pending.push_back(halves[h]);
+		}
+	}
+}
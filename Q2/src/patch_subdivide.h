@@ -0,0 +1,57 @@
+#ifndef PATCH_SUBDIVIDE_H
+#define PATCH_SUBDIVIDE_H
+
+#include "bezier_patch.h"
+#include <vector>
+
+// Exact splitting of cubic Bezier curves and patches by de Casteljau's
+// algorithm. The pieces are Bezier themselves, with control points that only
+// need the original ones, so they can be split again and tested for
+// flatness without evaluating the surface.
+
+// Split a cubic at t into the parts over [0, t] and [t, 1]
+void split_curve(const point3 in[4], float t, point3 low[4], point3 high[4]);
+
+// The control points of one cubic over [a, b] of its parameter
+void curve_segment(const point3 in[4], float a, float b, point3 out[4]);
+
+// The control net of the part of a patch over [u0, u1] x [v0, v1]
+void sub_patch(const point3 cps[16], float u0, float u1, float v0, float v1, point3 out[16]);
+
+// Split a patch across u (or v) at the given parameter into the part below it
+// and the part above
+void split_patch_u(const point3 cps[16], float u, point3 low[16], point3 high[16]);
+void split_patch_v(const point3 cps[16], float v, point3 low[16], point3 high[16]);
+
+// Split a patch at (u,v) into four, [0,u] x [0,v], [0,u] x [v,1], [u,1] x [0,v]
+// and [u,1] x [v,1] in that order
+void split_patch(const point3 cps[16], float u, float v, point3 out[4][16]);
+
+// How flat a patch is. error bounds how far the surface is from the two
+// triangles between its corners: the surface is a Bezier patch with the
+// same parameters as the bilinear quad through the corners, so it stays
+// within the largest distance of a control point from where the quad puts
+// it, and the quad is within a quarter of its twist of either pair of
+// triangles. along_u and along_v are how far the control polygons running in
+// each direction bend away from their chords, which says which way a split
+// flattens more.
+struct Flatness {
+	float error, along_u, along_v;
+};
+Flatness patch_flatness(const point3 cps[16]);
+
+// A rectangle of a patch's domain, [u0, u1] x [v0, v1] in steps of
+// 1 / subdivision_steps
+struct PatchRegion {
+	int u0, v0, u1, v1;
+};
+const int max_subdivision_depth = 10;
+const int subdivision_steps = 1 << max_subdivision_depth;
+
+// Split a patch in halves, across u, v or both, whichever its control net
+// bends along, until each piece is flat to within tolerance or has been
+// halved max_subdivision_depth times each way. The pieces are appended to
+// regions.
+void subdivide_patch(const point3 cps[16], float tolerance, std::vector<PatchRegion> &regions);
+
+#endif // PATCH_SUBDIVIDE_H
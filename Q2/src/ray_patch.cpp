@@ -0,0 +1,189 @@
+#include "ray_patch.h"
+#include "patch_subdivide.h"
+#include <algorithm>
+#include <cmath>
+
+// Newton converges in two or three steps from inside the right cell; more
+// than this means it is wandering
+static const int max_newton_steps = 8;
+
+// Cells are found a little loosely and a converged (u,v) may land just past
+// an edge that a neighbour shares
+static const float domain_slack = 1e-4f;
+
+// Slab test: where the ray enters the box, if it does before t_max
+static inline bool enters(const Bounds &b, const Ray &ray, const point3 &inverse_direction, float t_max, float &t_enter) {
+	point3 t0 = (b.lo - ray.origin) * inverse_direction;
+	point3 t1 = (b.hi - ray.origin) * inverse_direction;
+	point3 near_t = glm::min(t0, t1), far_t = glm::max(t0, t1);
+	t_enter = std::max(std::max(near_t.x, near_t.y), std::max(near_t.z, 0.0f));
+	float t_exit = std::min(std::min(far_t.x, far_t.y), std::min(far_t.z, t_max));
+	return t_enter <= t_exit;
+}
+
+static inline point3 reciprocal(const point3 &d) {
+	return point3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+}
+
+void PatchRayCaster::build(const std::vector<BezierPatch> &patches_, const PatchBVH &bvh_) {
+	patches = &patches_;
+	bvh = &bvh_;
+	patch_cells.resize(patches_.size());
+	for (int p = 0; p < patches_.size(); p++)
+		build_cells(p);
+}
+
+void PatchRayCaster::build_cells(int patch) {
+	PatchCells &cells = patch_cells[patch];
+	const float step = 1.0f / cells_per_side;
+	cells.bounds = Bounds();
+	for (int i = 0; i < cells_per_side; i++) {
+		for (int j = 0; j < cells_per_side; j++) {
+			point3 net[16];
+			sub_patch((*patches)[patch].cps, i * step, (i + 1) * step, j * step, (j + 1) * step, net);
+			Bounds &cell = cells.cells[i * cells_per_side + j];
+			cell = Bounds();
+			for (int k = 0; k < 16; k++)
+				cell.grow(net[k]);
+			cells.bounds.grow(cell);
+		}
+	}
+	cells.tolerance = 1e-5f * length(cells.bounds.hi - cells.bounds.lo);
+}
+
+// The ray is where two planes through it meet, so a hit is a root of
+// F(u,v) = (dot(n1, S) + d1, dot(n2, S) + d2), whose Jacobian is just the
+// planes' normals against the tangents Su and Sv
+bool PatchRayCaster::intersect_patch(int patch, const Ray &ray, const point3 &inverse_direction, RayHit &hit) const {
+	const PatchCells &cells = patch_cells[patch];
+	float t_enter;
+	if (!enters(cells.bounds, ray, inverse_direction, hit.t, t_enter))
+		return false;
+
+	// Cells the ray passes through, nearest first
+	const int num_cells = cells_per_side * cells_per_side;
+	float cell_t[num_cells];
+	int cell_order[num_cells];
+	int num_hit = 0;
+	for (int c = 0; c < num_cells; c++) {
+		if (!enters(cells.cells[c], ray, inverse_direction, hit.t, t_enter))
+			continue;
+		int k = num_hit++;
+		for (; k > 0 && cell_t[k - 1] > t_enter; k--) {
+			cell_t[k] = cell_t[k - 1];
+			cell_order[k] = cell_order[k - 1];
+		}
+		cell_t[k] = t_enter;
+		cell_order[k] = c;
+	}
+	if (num_hit == 0)
+		return false;
+
+	point3 d = ray.direction;
+	point3 a = (std::abs(d.x) > std::abs(d.y) && std::abs(d.x) > std::abs(d.z)) ? point3(0.0, 1.0, 0.0) : point3(1.0, 0.0, 0.0);
+	point3 n1 = normalize(cross(d, a));
+	point3 n2 = normalize(cross(n1, d));
+	float d1 = -dot(n1, ray.origin), d2 = -dot(n2, ray.origin);
+
+	const BezierPatch &bezier = (*patches)[patch];
+	const float step = 1.0f / cells_per_side;
+	bool found = false;
+	for (int k = 0; k < num_hit && cell_t[k] < hit.t; k++) {
+		float u = (cell_order[k] / cells_per_side + 0.5f) * step;
+		float v = (cell_order[k] % cells_per_side + 0.5f) * step;
+		point3 S, Su, Sv;
+		bool converged = false;
+		for (int i = 0; i < max_newton_steps; i++) {
+			bezier.patch_point_tangents(u, v, S, Su, Sv);
+			float f1 = dot(n1, S) + d1, f2 = dot(n2, S) + d2;
+			if (std::abs(f1) + std::abs(f2) < cells.tolerance) {
+				converged = true;
+				break;
+			}
+			float j11 = dot(n1, Su), j12 = dot(n1, Sv);
+			float j21 = dot(n2, Su), j22 = dot(n2, Sv);
+			float det = j11 * j22 - j12 * j21;
+			if (det == 0.0f)
+				break;
+			u -= (j22 * f1 - j12 * f2) / det;
+			v -= (j11 * f2 - j21 * f1) / det;
+			if (u < -0.5f || u > 1.5f || v < -0.5f || v > 1.5f)
+				break;
+		}
+		if (!converged || u < -domain_slack || u > 1.0f + domain_slack || v < -domain_slack || v > 1.0f + domain_slack)
+			continue;
+
+		float t = dot(S - ray.origin, d) / dot(d, d);
+		if (t <= 0.0f || t >= hit.t)
+			continue;
+		hit.t = t;
+		hit.u = glm::clamp(u, 0.0f, 1.0f);
+		hit.v = glm::clamp(v, 0.0f, 1.0f);
+		hit.patch = patch;
+		found = true;
+	}
+	return found;
+}
+
+bool PatchRayCaster::intersect(const Ray &ray, RayHit &hit) const {
+	if (bvh == NULL || bvh->tree().empty())
+		return false;
+	const std::vector<PatchBVH::Node> &nodes = bvh->tree();
+	point3 inverse_direction = reciprocal(ray.direction);
+
+	bool found = false;
+	int stack[64];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		int index = stack[--depth];
+		const PatchBVH::Node &node = nodes[index];
+		float t_enter;
+		if (!enters(node.bounds, ray, inverse_direction, hit.t, t_enter))
+			continue;
+		if (node.right < 0) {
+			for (int i = 0; i < node.count; i++)
+				found |= intersect_patch(bvh->leaf_patch(node, i), ray, inverse_direction, hit);
+			continue;
+		}
+		stack[depth++] = node.right;
+		stack[depth++] = index + 1;
+	}
+	return found;
+}
+
+// The packet goes down the tree together, into any node that at least one of
+// its rays enters, so a node's box is fetched once for all of them
+void PatchRayCaster::intersect_packet(const Ray *rays, int count, RayHit *hits) const {
+	if (bvh == NULL || bvh->tree().empty() || count <= 0)
+		return;
+	const std::vector<PatchBVH::Node> &nodes = bvh->tree();
+	point3 inverse_directions[max_packet];
+	for (int r = 0; r < count; r++)
+		inverse_directions[r] = reciprocal(rays[r].direction);
+
+	int stack[64];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		int index = stack[--depth];
+		const PatchBVH::Node &node = nodes[index];
+		// Rays before first miss the node, so later tests can skip them
+		int first = 0;
+		float t_enter;
+		while (first < count && !enters(node.bounds, rays[first], inverse_directions[first], hits[first].t, t_enter))
+			first++;
+		if (first == count)
+			continue;
+		if (node.right < 0) {
+			for (int i = 0; i < node.count; i++) {
+				int patch = bvh->leaf_patch(node, i);
+				for (int r = first; r < count; r++)
+					intersect_patch(patch, rays[r], inverse_directions[r], hits[r]);
+			}
+			continue;
+		}
+		stack[depth++] = node.right;
+		stack[depth++] = index + 1;
+	}
+}
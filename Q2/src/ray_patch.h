@@ -0,0 +1,61 @@
+#ifndef RAY_PATCH_H
+#define RAY_PATCH_H
+
+#include "bezier_patch.h"
+#include "patch_bvh.h"
+#include <vector>
+
+struct Ray {
+	point3 origin, direction;
+};
+
+// The nearest surface point found along a ray, at origin + t * direction.
+// patch stays -1 for a miss.
+struct RayHit {
+	float t, u, v;
+	int patch;
+	RayHit() : t(1e30f), u(0.0), v(0.0), patch(-1) {}
+};
+
+// Finds where rays meet the patches, walking the patch BVH down to the
+// patches a ray can reach and then solving for (u,v) by Newton's method.
+//
+// Each patch is subdivided into cells_per_side x cells_per_side cells ahead
+// of time, with a box around each cell's own control net. A ray only starts
+// Newton in the cells it passes through, nearest first, so the iteration
+// starts close to the root it converges to and a ray through two folds of
+// one patch finds the nearer.
+class PatchRayCaster {
+public:
+	static const int cells_per_side = 4;
+private:
+	struct PatchCells {
+		Bounds bounds;
+		Bounds cells[cells_per_side * cells_per_side];
+		float tolerance; // how far from the ray a converged point may be
+	};
+	std::vector<PatchCells> patch_cells;
+	const std::vector<BezierPatch> *patches;
+	const PatchBVH *bvh;
+	void build_cells(int patch);
+	bool intersect_patch(int patch, const Ray &ray, const point3 &inverse_direction, RayHit &hit) const;
+public:
+	PatchRayCaster() : patches(NULL), bvh(NULL) {}
+	// Both have to outlive the caster, and the BVH has to be built over the
+	// same patches
+	void build(const std::vector<BezierPatch> &patches, const PatchBVH &bvh);
+	// Point at the same patches and BVH where they are now, after they have
+	// been swapped into other objects
+	void rebind(const std::vector<BezierPatch> &patches_, const PatchBVH &bvh_) { patches = &patches_; bvh = &bvh_; }
+	// Redo the cells of a patch that has changed
+	void update_patch(int patch) { build_cells(patch); }
+	// Replace hit with the ray's nearest hit if that is nearer than hit.t, and
+	// say whether it was. Before build, nothing is hit.
+	bool intersect(const Ray &ray, RayHit &hit) const;
+	// The same for up to max_packet rays at once, which share the BVH walk.
+	// Worth it when the rays are coherent, like neighbouring pixels.
+	static const int max_packet = 64;
+	void intersect_packet(const Ray *rays, int count, RayHit *hits) const;
+};
+
+#endif // RAY_PATCH_H
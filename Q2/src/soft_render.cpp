@@ -0,0 +1,252 @@
+#include "soft_render.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+point3 shaded_color(const point3 &normal, const point3 &eye_position) {
+	point3 L = normalize(point3(0.5, 1.0, 1.0));
+	point3 E = normalize(-eye_position);
+	point3 H = normalize(L + E);
+	float diffuse = std::max(dot(L, normal), 0.0f);
+	float specular = pow(std::max(dot(normal, H), 0.0f), 40.0f);
+	return point3(0.15) + point3(0.7, 0.6, 0.5) * diffuse + point3(0.3) * specular;
+}
+
+void SoftwareRenderer::resize(int width_, int height_) {
+	width = width_;
+	height = height_;
+	color.resize(size_t(width) * height * 3);
+	tiles_across = (width + tile_size - 1) / tile_size;
+	tiles_down = (height + tile_size - 1) / tile_size;
+	bins.resize(tiles_across * tiles_down);
+}
+
+int SoftwareRenderer::triangles_drawn() const {
+	int drawn = 0;
+	for (int i = 0; i < triangle_counts.size(); i++)
+		drawn += triangle_counts[i];
+	return drawn;
+}
+
+// Divide by w and map to pixels, or return false if nothing is left to draw
+bool SoftwareRenderer::add_triangle(Triangle &out, const Vertex &a, const Vertex &b, const Vertex &c) {
+	// Corners are kept within a guard band a million pixels past the screen,
+	// which keeps the edge functions' products within 64 bits
+	const float guard_band = 1 << 20, one = 1 << subpixel_bits;
+	const Vertex *v[3] = { &a, &b, &c };
+	for (int i = 0; i < 3; i++) {
+		float inverse_w = 1.0f / v[i]->clip.w;
+		float x = (v[i]->clip.x * inverse_w * 0.5f + 0.5f) * width;
+		float y = (0.5f - v[i]->clip.y * inverse_w * 0.5f) * height;
+		out.x[i] = llround(std::min(std::max(x, -guard_band), guard_band) * one);
+		out.y[i] = llround(std::min(std::max(y, -guard_band), guard_band) * one);
+		out.z[i] = v[i]->clip.z * inverse_w * 0.5f + 0.5f;
+		out.inverse_w[i] = inverse_w;
+		out.normal_w[i] = v[i]->normal * inverse_w;
+		out.position_w[i] = v[i]->position * inverse_w;
+	}
+	out.area = (out.x[1] - out.x[0]) * (out.y[2] - out.y[0]) - (out.x[2] - out.x[0]) * (out.y[1] - out.y[0]);
+	if (out.area == 0)
+		return false;
+	// Counter-clockwise with y up, as GL takes front faces, is clockwise with y down
+	out.front_facing = out.area < 0;
+
+	// Pixels whose centres lie inside the triangle's box
+	long long lo_x = std::min(std::min(out.x[0], out.x[1]), out.x[2]), hi_x = std::max(std::max(out.x[0], out.x[1]), out.x[2]);
+	long long lo_y = std::min(std::min(out.y[0], out.y[1]), out.y[2]), hi_y = std::max(std::max(out.y[0], out.y[1]), out.y[2]);
+	out.x0 = int(std::max(ceil(lo_x / double(one) - 0.5), 0.0));
+	out.y0 = int(std::max(ceil(lo_y / double(one) - 0.5), 0.0));
+	out.x1 = int(std::min(floor(hi_x / double(one) - 0.5), width - 1.0));
+	out.y1 = int(std::min(floor(hi_y / double(one) - 0.5), height - 1.0));
+	return out.x0 <= out.x1 && out.y0 <= out.y1;
+}
+
+// Set up mesh triangle t into slots 2t and 2t + 1. Triangles crossing the
+// near plane (z = -w) are cut down to the part in front of it, which takes two
+// triangles when one corner is cut off. The other planes need no clipping, as
+// the pixel box is limited to the screen.
+void SoftwareRenderer::set_up(const TriangleMesh &mesh, int t) {
+	const Vertex *v[3];
+	for (int i = 0; i < 3; i++)
+		v[i] = &vertices[mesh.indices[3 * t + i]];
+	triangle_counts[t] = 0;
+
+	// Entirely outside one plane of the view volume
+	for (int axis = 0; axis < 3; axis++) {
+		for (float side = -1.0f; side <= 1.0f; side += 2.0f) {
+			int outside = 0;
+			for (int i = 0; i < 3; i++)
+				outside += side * v[i]->clip[axis] > v[i]->clip.w;
+			if (outside == 3)
+				return;
+		}
+	}
+
+	float d[3];
+	int inside = 0;
+	for (int i = 0; i < 3; i++) {
+		d[i] = v[i]->clip.z + v[i]->clip.w;
+		inside += d[i] >= 0.0f;
+	}
+	if (inside == 3) {
+		triangle_counts[t] = add_triangle(triangles[2 * t], *v[0], *v[1], *v[2]);
+		return;
+	}
+
+	// Sutherland-Hodgman against the near plane, which leaves 3 or 4 corners
+	Vertex polygon[4];
+	int corners = 0;
+	for (int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3;
+		if (d[i] >= 0.0f)
+			polygon[corners++] = *v[i];
+		if ((d[i] >= 0.0f) != (d[j] >= 0.0f))
+			polygon[corners++] = lerp(*v[i], *v[j], d[i] / (d[i] - d[j]));
+	}
+	for (int k = 0; k + 2 < corners; k++) {
+		if (add_triangle(triangles[2 * t + triangle_counts[t]], polygon[0], polygon[k + 1], polygon[k + 2]))
+			triangle_counts[t]++;
+	}
+}
+
+SoftwareRenderer::Vertex SoftwareRenderer::lerp(const Vertex &a, const Vertex &b, float s) {
+	Vertex v;
+	v.clip = glm::mix(a.clip, b.clip, s);
+	v.normal = glm::mix(a.normal, b.normal, s);
+	v.position = glm::mix(a.position, b.position, s);
+	return v;
+}
+
+void SoftwareRenderer::draw_tile(int tile) {
+	const int tile_x = tile % tiles_across * tile_size, tile_y = tile / tiles_across * tile_size;
+	const int tile_width = std::min(tile_size, width - tile_x), tile_height = std::min(tile_size, height - tile_y);
+
+	// Nearest triangle at each pixel, and where in it as the weights of its
+	// second and third corners
+	float depth[tile_size * tile_size];
+	int nearest[tile_size * tile_size];
+	float weight1[tile_size * tile_size], weight2[tile_size * tile_size];
+	for (int i = 0; i < tile_size * tile_size; i++) {
+		depth[i] = 1.0f;
+		nearest[i] = -1;
+	}
+
+	const std::vector<int> &bin = bins[tile];
+	for (int b = 0; b < bin.size(); b++) {
+		const Triangle &tri = triangles[bin[b]];
+		int x0 = std::max(tri.x0, tile_x), x1 = std::min(tri.x1, tile_x + tile_width - 1);
+		int y0 = std::max(tri.y0, tile_y), y1 = std::min(tri.y1, tile_y + tile_height - 1);
+
+		// Each corner's weight is the area of the triangle the pixel makes
+		// with the opposite edge over the whole area. The areas are the edge
+		// functions e = a x + b y + c, exact on the subpixel grid, and are
+		// only divided by the whole area to interpolate.
+		const long long one = 1 << subpixel_bits;
+		long long edge_a[3], edge_b[3], edge_c[3];
+		for (int k = 0; k < 3; k++) {
+			int i = (k + 1) % 3, j = (k + 2) % 3;
+			edge_a[k] = tri.y[i] - tri.y[j];
+			edge_b[k] = tri.x[j] - tri.x[i];
+			edge_c[k] = tri.x[i] * tri.y[j] - tri.x[j] * tri.y[i];
+			// Turn every edge function positive inside
+			if (tri.area < 0) {
+				edge_a[k] = -edge_a[k];
+				edge_b[k] = -edge_b[k];
+				edge_c[k] = -edge_c[k];
+			}
+		}
+		// A pixel centre exactly on an edge belongs to the triangle to its
+		// right or below it, so two triangles sharing the edge never both draw
+		// it or both leave it out: ties count only on left and top edges
+		long long bias[3];
+		for (int k = 0; k < 3; k++)
+			bias[k] = (edge_a[k] > 0 || (edge_a[k] == 0 && edge_b[k] > 0)) ? 0 : -1;
+		float inverse_area = 1.0f / std::abs(tri.area);
+		float dz1 = tri.z[1] - tri.z[0], dz2 = tri.z[2] - tri.z[0];
+
+		for (int y = y0; y <= y1; y++) {
+			long long py = y * one + one / 2, px = x0 * one + one / 2;
+			long long e0 = edge_a[0] * px + edge_b[0] * py + edge_c[0];
+			long long e1 = edge_a[1] * px + edge_b[1] * py + edge_c[1];
+			long long e2 = edge_a[2] * px + edge_b[2] * py + edge_c[2];
+			for (int x = x0; x <= x1; x++, e0 += edge_a[0] * one, e1 += edge_a[1] * one, e2 += edge_a[2] * one) {
+				if (e0 + bias[0] < 0 || e1 + bias[1] < 0 || e2 + bias[2] < 0)
+					continue;
+				float w1 = e1 * inverse_area, w2 = e2 * inverse_area;
+				float z = tri.z[0] + w1 * dz1 + w2 * dz2;
+				int i = (y - tile_y) * tile_size + (x - tile_x);
+				if (z < 0.0f || z >= depth[i])
+					continue;
+				depth[i] = z;
+				nearest[i] = bin[b];
+				weight1[i] = w1;
+				weight2[i] = w2;
+			}
+		}
+	}
+
+	for (int y = 0; y < tile_height; y++) {
+		unsigned char *row = &color[3 * ((size_t(tile_y) + y) * width + tile_x)];
+		for (int x = 0; x < tile_width; x++) {
+			int i = y * tile_size + x;
+			if (nearest[i] < 0) {
+				row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = 255;
+				continue;
+			}
+			const Triangle &tri = triangles[nearest[i]];
+			float w[3] = { 1.0f - weight1[i] - weight2[i], weight1[i], weight2[i] };
+			float inverse_w = 0.0f;
+			point3 normal(0.0), position(0.0);
+			for (int k = 0; k < 3; k++) {
+				inverse_w += w[k] * tri.inverse_w[k];
+				normal += w[k] * tri.normal_w[k];
+				position += w[k] * tri.position_w[k];
+			}
+			normal = normalize(normal);
+			if (!tri.front_facing)
+				normal = -normal;
+			point3 c = shaded_color(normal, position / inverse_w);
+			for (int k = 0; k < 3; k++)
+				row[3 * x + k] = (unsigned char)(std::min(c[k], 1.0f) * 255.0f + 0.5f);
+		}
+	}
+}
+
+void SoftwareRenderer::render(WorkerPool &pool, const TriangleMesh &mesh, const glm::mat4 &model_view, const glm::mat4 &projection) {
+	// ModelView only rotates, translates and scales uniformly, so it can
+	// transform normals directly, as in vshader_shaded.glsl
+	vertices.resize(mesh.positions.size());
+	pool.parallel_for(0, vertices.size(), 4096, [&](int first, int last) {
+		for (int i = first; i < last; i++) {
+			glm::vec4 eye = model_view * point4(mesh.positions[i], 1.0);
+			vertices[i].clip = projection * eye;
+			vertices[i].position = point3(eye);
+			vertices[i].normal = point3(model_view * point4(mesh.normals[i], 0.0));
+		}
+	});
+
+	int num_triangles = mesh.indices.size() / 3;
+	triangles.resize(2 * size_t(num_triangles));
+	triangle_counts.resize(num_triangles);
+	pool.parallel_for(0, num_triangles, 1024, [&](int first, int last) {
+		for (int t = first; t < last; t++)
+			set_up(mesh, t);
+	});
+
+	// Binning stays on one thread: it only touches each triangle's box
+	for (int i = 0; i < bins.size(); i++)
+		bins[i].clear();
+	for (int t = 0; t < num_triangles; t++) {
+		for (int k = 0; k < triangle_counts[t]; k++) {
+			const Triangle &tri = triangles[2 * t + k];
+			for (int ty = tri.y0 / tile_size; ty <= tri.y1 / tile_size; ty++)
+				for (int tx = tri.x0 / tile_size; tx <= tri.x1 / tile_size; tx++)
+					bins[ty * tiles_across + tx].push_back(2 * t + k);
+		}
+	}
+
+	pool.parallel_for(0, bins.size(), 1, [&](int first, int last) {
+		for (int tile = first; tile < last; tile++)
+			draw_tile(tile);
+	});
+}
@@ -0,0 +1,64 @@
+#ifndef SOFT_RENDER_H
+#define SOFT_RENDER_H
+
+#include "bezier_patch.h"
+#include "patch_mesh.h"
+#include "worker_pool.h"
+#include <vector>
+
+// The colour fshader_shaded.glsl gives a point, from its eye space position
+// and its normal already turned towards the side being seen
+point3 shaded_color(const point3 &normal, const point3 &eye_position);
+
+// Draws a triangle mesh the way the shaded mode does, with no GL at all.
+//
+// The mesh is transformed and set up once per frame, clipped against the near
+// plane, and each triangle is binned into the square screen tiles its box
+// covers. The tiles are then shared out over a worker pool; each keeps its
+// own depth buffer, first finds the nearest triangle at every pixel and only
+// then shades the pixels that ended up covered.
+class SoftwareRenderer {
+public:
+	static const int tile_size = 32;
+	// Corners are snapped to 1/256 of a pixel, so that the edge shared by two
+	// triangles gives exactly opposite values in both
+	static const int subpixel_bits = 8;
+private:
+	struct Vertex {
+		glm::vec4 clip;
+		point3 normal, position; // eye space
+	};
+	// Screen coordinates with y down, ready to interpolate: attributes are
+	// divided by w so that they are linear on screen
+	struct Triangle {
+		long long x[3], y[3]; // snapped to the subpixel grid
+		float z[3], inverse_w[3];
+		point3 normal_w[3], position_w[3];
+		long long area; // twice the signed area on screen, in subpixel units
+		bool front_facing;
+		int x0, y0, x1, y1; // pixels covered, inclusive
+	};
+	int width, height;
+	std::vector<unsigned char> color;
+	std::vector<Vertex> vertices;
+	std::vector<Triangle> triangles; // two slots per mesh triangle, for near clipping
+	std::vector<int> triangle_counts;
+	std::vector<std::vector<int> > bins;
+	int tiles_across, tiles_down;
+	void set_up(const TriangleMesh &mesh, int triangle);
+	static Vertex lerp(const Vertex &a, const Vertex &b, float s);
+	bool add_triangle(Triangle &out, const Vertex &a, const Vertex &b, const Vertex &c);
+	void draw_tile(int tile);
+public:
+	SoftwareRenderer() : width(0), height(0), tiles_across(0), tiles_down(0) {}
+	void resize(int width, int height);
+	// Clear to white and draw the mesh from the given camera, as
+	// glm::perspective and the model-view matrix would in GL
+	void render(WorkerPool &pool, const TriangleMesh &mesh, const glm::mat4 &model_view, const glm::mat4 &projection);
+	// RGB, top row first, as write_ppm takes
+	const unsigned char *pixels() const { return &color[0]; }
+	// Triangles left after clipping and culling in the last frame
+	int triangles_drawn() const;
+};
+
+#endif // SOFT_RENDER_H
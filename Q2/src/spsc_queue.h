@@ -0,0 +1,44 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+
+// A bounded queue between exactly one producer thread and one consumer
+// thread, with no locks. Each side only ever writes its own index: the
+// producer fills a slot and then publishes it by moving tail on with release
+// ordering, and the consumer's acquire load of tail sees the slot filled. The
+// consumer hands slots back through head the same way.
+//
+// The indices only grow and wrap around with unsigned arithmetic, so
+// Capacity has to be a power of two.
+template <typename T, unsigned Capacity>
+class SpscQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+	T slots[Capacity];
+	alignas(64) std::atomic<unsigned> head; // next slot to pop, written by the consumer
+	alignas(64) std::atomic<unsigned> tail; // next slot to push, written by the producer
+	SpscQueue(const SpscQueue &);
+	SpscQueue &operator=(const SpscQueue &);
+public:
+	SpscQueue() : head(0), tail(0) {}
+	// Producer only. False if the queue is full.
+	bool push(const T &value) {
+		unsigned t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity)
+			return false;
+		slots[t % Capacity] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer only. False if the queue is empty.
+	bool pop(T &value) {
+		unsigned h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = slots[h % Capacity];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,59 @@
+#include "stream_buffer.h"
+#include <algorithm>
+
+static GLsizeiptr round_up(GLsizeiptr size) {
+	return (size + 255) / 256 * 256;
+}
+
+void StreamBuffer::create(GLsizeiptr initial_region_size) {
+	region_size = round_up(initial_region_size);
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, regions * region_size, NULL, GL_STREAM_DRAW);
+}
+
+void *StreamBuffer::map(GLsizeiptr size, GLintptr &offset) {
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	region = (region + 1) % regions;
+
+	if (size > region_size) {
+		// Fresh storage has nothing in flight, so the old fences no longer matter
+		region_size = round_up(std::max(size, 2 * region_size));
+		glBufferData(GL_COPY_WRITE_BUFFER, regions * region_size, NULL, GL_STREAM_DRAW);
+		for (int i = 0; i < regions; i++) {
+			if (fences[i])
+				glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+		region = 0;
+	}
+	else if (fences[region]) {
+		// Flushing makes sure the fence is on its way to the GPU, or this
+		// could wait for ever
+		while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(fences[region]);
+		fences[region] = 0;
+	}
+
+	offset = region * region_size;
+	mapped = size > 0;
+	if (!mapped)
+		return NULL;
+	return glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size,
+		GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+void StreamBuffer::unmap() {
+	if (!mapped)
+		return;
+	mapped = false;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
+
+void StreamBuffer::end_frame() {
+	if (fences[region])
+		glDeleteSync(fences[region]);
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
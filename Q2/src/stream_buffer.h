@@ -0,0 +1,46 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include "common.h"
+
+// A buffer for geometry that is rebuilt every frame, written once per frame
+// and drawn from straight away.
+//
+// The buffer is a ring of regions, one per frame in flight. Each frame maps
+// the next region unsynchronized, so GL never waits on draws still reading
+// earlier frames, and a fence placed after the frame's draws says when the
+// region may be written again. Only when the ring comes back round to a
+// region whose frame the GPU has not finished does the CPU wait.
+//
+// Mapping and resizing go through GL_COPY_WRITE_BUFFER, so they leave the
+// bindings of whatever vertex array is current alone.
+class StreamBuffer {
+public:
+	static const int regions = 3;
+private:
+	GLuint buffer;
+	GLsizeiptr region_size;
+	int region;
+	bool mapped;
+	GLsync fences[regions];
+	StreamBuffer(const StreamBuffer &);
+	StreamBuffer &operator=(const StreamBuffer &);
+public:
+	StreamBuffer() : buffer(0), region_size(0), region(regions - 1), mapped(false) {
+		for (int i = 0; i < regions; i++)
+			fences[i] = 0;
+	}
+	void create(GLsizeiptr initial_region_size);
+	GLuint id() const { return buffer; }
+	// Map the next region for this frame's size bytes and say where they start
+	// in the buffer. The offset is a multiple of 256, so any vertex format can
+	// start there. A frame bigger than a region grows all of them, orphaning
+	// the old storage to the draws still using it. Nothing is mapped for a
+	// size of 0, and NULL comes back.
+	void *map(GLsizeiptr size, GLintptr &offset);
+	void unmap();
+	// After the last draw from the region mapped this frame
+	void end_frame();
+};
+
+#endif // STREAM_BUFFER_H
@@ -0,0 +1,42 @@
+#version 400
+
+// Picks tessellation levels for one 16-point Bezier patch from how long its
+// boundary control polygons are on screen.
+layout(vertices = 16) out;
+
+in vec3 vControl[];
+out vec3 tcControl[];
+uniform mat4 ModelView, Projection;
+uniform vec2 Viewport;
+uniform float PixelsPerSegment;
+
+vec2 to_screen(vec3 p)
+{
+    vec4 clip = Projection * ModelView * vec4(p, 1.0);
+    return clip.xy / max(clip.w, 1e-3) * 0.5 * Viewport;
+}
+
+// Each level depends only on the four control points of its own boundary,
+// summed the same way in either direction, so both patches sharing an edge
+// pick the same level and no cracks open between them
+float edge_level(int a, int b, int c, int d)
+{
+    vec2 pa = to_screen(vControl[a]), pb = to_screen(vControl[b]);
+    vec2 pc = to_screen(vControl[c]), pd = to_screen(vControl[d]);
+    float pixels = (distance(pa, pb) + distance(pc, pd)) + distance(pb, pc);
+    return clamp(pixels / PixelsPerSegment, 1.0, 64.0);
+}
+
+void main()
+{
+    tcControl[gl_InvocationID] = vControl[gl_InvocationID];
+
+    if (gl_InvocationID == 0) {
+        gl_TessLevelOuter[0] = edge_level(0, 1, 2, 3);     // u = 0
+        gl_TessLevelOuter[1] = edge_level(0, 4, 8, 12);    // v = 0
+        gl_TessLevelOuter[2] = edge_level(12, 13, 14, 15); // u = 1
+        gl_TessLevelOuter[3] = edge_level(3, 7, 11, 15);   // v = 1
+        gl_TessLevelInner[0] = max(gl_TessLevelOuter[1], gl_TessLevelOuter[3]);
+        gl_TessLevelInner[1] = max(gl_TessLevelOuter[0], gl_TessLevelOuter[2]);
+    }
+}
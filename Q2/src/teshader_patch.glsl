@@ -0,0 +1,52 @@
+#version 400
+
+// Evaluates the bicubic Bezier patch and its normal at each generated vertex
+layout(quads, equal_spacing, ccw) in;
+
+in vec3 tcControl[];
+out vec3 fNormal;
+out vec3 fPosition;
+uniform mat4 ModelView, Projection;
+
+vec4 bernstein(float t)
+{
+    float s = 1.0 - t;
+    return vec4(s*s*s, 3.0*t*s*s, 3.0*t*t*s, t*t*t);
+}
+
+vec4 bernstein_derivative(float t)
+{
+    float s = 1.0 - t;
+    return vec4(-3.0*s*s, 3.0*s*s - 6.0*t*s, 6.0*t*s - 3.0*t*t, 3.0*t*t);
+}
+
+void main()
+{
+    float u = gl_TessCoord.x;
+    float v = gl_TessCoord.y;
+    vec4 Bu = bernstein(u), Bv = bernstein(v);
+    vec4 dBu = bernstein_derivative(u), dBv = bernstein_derivative(v);
+
+    vec3 position = vec3(0.0), Su = vec3(0.0), Sv = vec3(0.0), Suv = vec3(0.0);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            vec3 cp = tcControl[4 * i + j];
+            position += Bu[i] * Bv[j] * cp;
+            Su += dBu[i] * Bv[j] * cp;
+            Sv += Bu[i] * dBv[j] * cp;
+            Suv += dBu[i] * dBv[j] * cp;
+        }
+    }
+
+    // Same pole fallback as BezierPatch::patch_point_normal
+    vec3 normal = cross(Su, Sv);
+    if (dot(normal, normal) <= 1e-12 * dot(Su, Su) * dot(Sv, Sv)) {
+        float inward_u = (u < 0.5) ? 1.0 : -1.0;
+        float inward_v = (v < 0.5) ? 1.0 : -1.0;
+        normal = inward_u * cross(Su, Suv) + inward_v * cross(Suv, Sv);
+    }
+
+    fNormal = (ModelView * vec4(normal, 0.0)).xyz;
+    fPosition = (ModelView * vec4(position, 1.0)).xyz;
+    gl_Position = Projection * ModelView * vec4(position, 1.0);
+}
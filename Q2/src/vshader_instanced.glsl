@@ -0,0 +1,18 @@
+#version 150
+
+in vec4 vPosition;
+in vec3 vNormal;
+in mat4 vInstance; // one model matrix per instance
+out vec3 fNormal;
+out vec3 fPosition;
+uniform mat4 ModelView, Projection;
+
+void main()
+{
+    // Instances only rotate, translate and scale uniformly, like ModelView,
+    // so their product can transform normals directly too
+    mat4 InstanceView = ModelView * vInstance;
+    fNormal = (InstanceView * vec4(vNormal, 0.0)).xyz;
+    fPosition = (InstanceView * vPosition).xyz;
+    gl_Position = Projection * InstanceView * vPosition;
+}
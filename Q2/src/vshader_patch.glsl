@@ -0,0 +1,52 @@
+#version 150
+
+// Evaluates one Bezier patch per instance at the (u,v) of each grid vertex.
+// Patches holds MGM_x, MGM_y and MGM_z of every patch, one column per texel,
+// and Visible the patch number of each instance.
+in vec2 vUV;
+out vec3 fNormal;
+out vec3 fPosition;
+uniform samplerBuffer Patches;
+uniform isamplerBuffer Visible;
+uniform mat4 ModelView, Projection;
+
+mat4 patch_matrix(int first)
+{
+    return mat4(texelFetch(Patches, first), texelFetch(Patches, first + 1),
+                texelFetch(Patches, first + 2), texelFetch(Patches, first + 3));
+}
+
+void main()
+{
+    int first = texelFetch(Visible, gl_InstanceID).r * 12;
+    mat4 MGM_x = patch_matrix(first);
+    mat4 MGM_y = patch_matrix(first + 4);
+    mat4 MGM_z = patch_matrix(first + 8);
+
+    float u = vUV.x;
+    float v = vUV.y;
+    vec4 U = vec4(u*u*u, u*u, u, 1.0);
+    vec4 V = vec4(v*v*v, v*v, v, 1.0);
+    vec4 dU = vec4(3.0*u*u, 2.0*u, 1.0, 0.0);
+    vec4 dV = vec4(3.0*v*v, 2.0*v, 1.0, 0.0);
+
+    vec4 MV_x = MGM_x * V, MV_y = MGM_y * V, MV_z = MGM_z * V;
+    vec4 UM_x = U * MGM_x, UM_y = U * MGM_y, UM_z = U * MGM_z;
+
+    vec4 position = vec4(dot(U, MV_x), dot(U, MV_y), dot(U, MV_z), 1.0);
+    vec3 Su = vec3(dot(dU, MV_x), dot(dU, MV_y), dot(dU, MV_z));
+    vec3 Sv = vec3(dot(UM_x, dV), dot(UM_y, dV), dot(UM_z, dV));
+    vec3 normal = cross(Su, Sv);
+
+    // Same pole fallback as BezierPatch::patch_point_normal
+    if (dot(normal, normal) <= 1e-12 * dot(Su, Su) * dot(Sv, Sv)) {
+        vec3 Suv = vec3(dot(dU, MGM_x * dV), dot(dU, MGM_y * dV), dot(dU, MGM_z * dV));
+        float inward_u = (u < 0.5) ? 1.0 : -1.0;
+        float inward_v = (v < 0.5) ? 1.0 : -1.0;
+        normal = inward_u * cross(Su, Suv) + inward_v * cross(Suv, Sv);
+    }
+
+    fNormal = (ModelView * vec4(normal, 0.0)).xyz;
+    fPosition = (ModelView * position).xyz;
+    gl_Position = Projection * ModelView * position;
+}
@@ -0,0 +1,16 @@
+#version 150
+
+in vec4 vPosition;
+in vec3 vNormal;
+out vec3 fNormal;
+out vec3 fPosition;
+uniform mat4 ModelView, Projection;
+
+void main()
+{
+    // ModelView only rotates, translates and scales uniformly, so it can
+    // transform normals directly
+    fNormal = (ModelView * vec4(vNormal, 0.0)).xyz;
+    fPosition = (ModelView * vPosition).xyz;
+    gl_Position = Projection * ModelView * vPosition;
+}
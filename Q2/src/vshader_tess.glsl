@@ -0,0 +1,9 @@
+#version 400
+
+in vec4 vPosition;
+out vec3 vControl;
+
+void main()
+{
+    vControl = vPosition.xyz;
+}
@@ -0,0 +1,77 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+void WorkerPool::start(int num_threads) {
+	stop();
+	if (num_threads <= 0)
+		num_threads = std::max(int(std::thread::hardware_concurrency()), 1);
+	stopping = false;
+	for (int i = 1; i < num_threads; i++)
+		threads.push_back(std::thread(&WorkerPool::worker, this, generation));
+}
+
+void WorkerPool::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (int i = 0; i < threads.size(); i++)
+		threads[i].join();
+	threads.clear();
+}
+
+void WorkerPool::run_chunks() {
+	for (;;) {
+		int first = next.fetch_add(grain);
+		if (first >= end)
+			return;
+		(*body)(first, std::min(first + grain, end));
+	}
+}
+
+// seen is the generation when the thread was started, so that it only picks
+// up work handed out after that
+void WorkerPool::worker(int seen) {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		while (!stopping && generation == seen)
+			wake.wait(lock);
+		if (stopping)
+			return;
+		seen = generation;
+
+		lock.unlock();
+		run_chunks();
+		lock.lock();
+		if (--busy == 0)
+			done.notify_one();
+	}
+}
+
+void WorkerPool::parallel_for(int begin, int end_, int grain_, const std::function<void(int, int)> &body_) {
+	if (threads.empty() || end_ - begin <= grain_) {
+		if (begin < end_)
+			body_(begin, end_);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	body = &body_;
+	end = end_;
+	grain = std::max(grain_, 1);
+	next = begin;
+	busy = int(threads.size());
+	generation++;
+	lock.unlock();
+	wake.notify_all();
+
+	run_chunks();
+
+	// Workers that wake after the caller took the last chunk find nothing
+	// left, but body has to stay valid until they have all looked
+	lock.lock();
+	while (busy != 0)
+		done.wait(lock);
+	body = NULL;
+}
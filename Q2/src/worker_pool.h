@@ -0,0 +1,41 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that split ranges of work between them. The thread
+// calling parallel_for works too, so a pool started with 1 thread runs
+// everything on the caller with no hand-off at all.
+class WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(int, int)> *body;
+	int end, grain;
+	std::atomic<int> next;
+	int generation, busy;
+	bool stopping;
+	void run_chunks();
+	void worker(int seen);
+	WorkerPool(const WorkerPool &);
+	WorkerPool &operator=(const WorkerPool &);
+public:
+	WorkerPool() : body(NULL), end(0), grain(1), next(0), generation(0), busy(0), stopping(false) {}
+	~WorkerPool() { stop(); }
+	// Run on num_threads threads in all, or one per hardware thread for 0
+	void start(int num_threads);
+	void stop();
+	int size() const { return int(threads.size()) + 1; }
+	// Call body(first, last) on chunks of at most grain indices that together
+	// cover [begin, end), from every thread at once, and return when all are
+	// done. Chunks never overlap, so body needs no locking as long as each
+	// index only writes its own part of the output.
+	void parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &body);
+};
+
+#endif // WORKER_POOL_H